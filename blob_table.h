@@ -0,0 +1,505 @@
+#ifndef BLOB_TABLE_H
+#define BLOB_TABLE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lock_stripe.h"
+#include "slab_alloc.h"
+#include "ebr.h"
+#include "hash.h"
+
+//
+// Table of 64-bit keys with byte string values (protocol v3 BSET, BGET,
+// BDEL).
+//
+// Chained, with lock stripes for writers and EBR read sections for
+// lock-free readers, like the table of 32-bit keys. A node never changes
+// once it is linked: a SET builds a new node, puts it in place of the old
+// one with one release store and retires the old one through EBR, so a
+// reader copies out the old value or the new one, never a mix.
+//
+// A node is 40 bytes, from a slab. A value of up to BLOB_INLINE_LEN bytes
+// sits in the node itself. A longer one is a record in the arena: a
+// 4-byte length, then the bytes, rounded up to the next BLOB_CLASS_STEP.
+// Each size class carves its records out of BLOB_ARENA_BLOCK blocks and
+// keeps the ones freed on a list of its own, so no value costs a malloc
+// or a header besides its length.
+//
+// The bucket array is a power of two and doubles once a stripe averages
+// BLOB_MAX_LOAD entries a bucket. As with the 32-bit keys, the old array
+// stays until writers have copied its chains over a few buckets at a
+// time, the copies sharing the records; each copied chain is retired on
+// its own. An old bucket and the two it becomes are in the same stripe,
+// as the stripe is the low bits of the bucket, so one lock covers both.
+//
+// With max_entries set (-C), a SET of a key that is missing fails with
+// BLOB_FULL once the table holds that many: values are never evicted.
+//
+
+#define BLOB_INLINE_LEN        16
+#define BLOB_MAX_LEN           4096
+#define BLOB_NUM_STRIPES       1024 /* power of two */
+#define BLOB_INITIAL_BUCKETS   (1u << 14)
+#define BLOB_MAX_LOAD          2
+#define BLOB_CLASS_STEP        8
+#define BLOB_RECORD_HDR        sizeof(uint32_t)
+#define BLOB_NUM_CLASSES       ((BLOB_RECORD_HDR + BLOB_MAX_LEN +\
+                                 BLOB_CLASS_STEP - 1) / BLOB_CLASS_STEP + 1)
+#define BLOB_ARENA_BLOCK       (64UL << 10)
+#define BLOB_MIGRATE_PER_OP    4    /* old buckets every SET or DEL copies */
+
+/* low bit of an old bucket head once its chain has been copied */
+#define BLOB_MIGRATED          ((uintptr_t) 1)
+
+enum { BLOB_INSERTED, BLOB_UPDATED, BLOB_TOO_LONG, BLOB_NO_MEMORY, BLOB_FULL };
+
+typedef struct blob_node_t {
+	struct blob_node_t * _Atomic next;
+	uint64_t              key;
+	uint32_t              len;
+	union {
+		unsigned char     bytes[BLOB_INLINE_LEN]; /* len <= BLOB_INLINE_LEN */
+		unsigned char    *record;                 /* else, in the arena */
+	};
+} blob_node;
+
+/* one generation of buckets; the stripes belong to the table */
+typedef struct blob_buckets_t {
+	uint64_t                mask;          /* buckets - 1 */
+	unsigned int            stripe_limit;  /* entries per stripe before growing */
+	_Atomic uint64_t        migrate_next;  /* next bucket to claim, if old */
+	_Atomic uint64_t        migrated;      /* buckets copied, if old */
+	blob_node * _Atomic     head[];
+} blob_buckets;
+
+/* records of one size class; lock is only ever write-locked */
+typedef struct blob_class_t {
+	lock_stripe    lock;
+	void          *free_list;             /* linked via their first word */
+	char          *bump;                  /* untouched space of the last block */
+	char          *bump_end;
+} blob_class;
+
+typedef struct blob_table_t {
+	blob_buckets * _Atomic  buckets;       /* all inserts go here */
+	blob_buckets * _Atomic  old_buckets;   /* being migrated, or NULL */
+	lock_stripe             stripes[BLOB_NUM_STRIPES];
+	size_t                  max_entries;   /* 0 unbounded */
+	_Atomic size_t          entries;       /* only kept with max_entries */
+	pthread_mutex_t         resize_lock;
+	slab_allocator          node_slab;
+	pthread_mutex_t         arena_lock;   /* guards blocks */
+	void                   *blocks;       /* linked via their first word */
+	blob_class              classes[BLOB_NUM_CLASSES];
+} blob_table;
+
+static inline blob_buckets *blob_buckets_create(uint64_t size) {
+
+	blob_buckets *b = (blob_buckets *) cache_aligned_alloc(sizeof(blob_buckets) +\
+	                  size * sizeof(blob_node *));
+	uint64_t i;
+
+	if (!b) return NULL;
+	b->mask         = size - 1;
+	b->stripe_limit = size / BLOB_NUM_STRIPES * BLOB_MAX_LOAD;
+	atomic_init(&b->migrate_next, 0);
+	atomic_init(&b->migrated, 0);
+	for (i = 0; i < size; i++) atomic_init(&b->head[i], NULL);
+	return b;
+}
+
+static inline blob_table *blob_table_create(void) {
+
+	blob_table *t = (blob_table *) cache_aligned_alloc(sizeof(blob_table));
+	unsigned int i;
+
+	if (!t) return NULL;
+	if (!(t->buckets = blob_buckets_create(BLOB_INITIAL_BUCKETS))) {
+		free(t);
+		return NULL;
+	}
+	atomic_init(&t->old_buckets, NULL);
+	for (i = 0; i < BLOB_NUM_STRIPES; i++) stripe_init(&t->stripes[i]);
+	t->max_entries = 0;
+	atomic_init(&t->entries, 0);
+	for (i = 0; i < BLOB_NUM_CLASSES; i++) {
+		stripe_init(&t->classes[i].lock);
+		t->classes[i].free_list = NULL;
+		t->classes[i].bump      = NULL;
+		t->classes[i].bump_end  = NULL;
+	}
+	pthread_mutex_init(&t->resize_lock, NULL);
+	pthread_mutex_init(&t->arena_lock, NULL);
+	slab_init(&t->node_slab, sizeof(blob_node));
+	t->blocks = NULL;
+	return t;
+}
+
+/* size class of a record holding len bytes */
+static inline unsigned int blob_class_of(uint32_t len) {
+	return (BLOB_RECORD_HDR + len + BLOB_CLASS_STEP - 1) / BLOB_CLASS_STEP;
+}
+
+/* a record for len bytes, length prefix set; NULL if out of memory */
+static inline unsigned char *blob_record_alloc(blob_table *t, uint32_t len) {
+
+	unsigned int c = blob_class_of(len);
+	size_t size = (size_t) c * BLOB_CLASS_STEP;
+	blob_class *cls = &t->classes[c];
+	char *rec, *block;
+
+	stripe_write_lock(&cls->lock);
+	if ((rec = (char *) cls->free_list) != NULL) {
+		cls->free_list = *(void **) rec;
+	} else {
+		if (cls->bump + size > cls->bump_end) {
+			if ((block = (char *) malloc(BLOB_ARENA_BLOCK)) == NULL) {
+				stripe_write_unlock(&cls->lock);
+				return NULL;
+			}
+			pthread_mutex_lock(&t->arena_lock);
+			*(void **) block = t->blocks;
+			t->blocks        = block;
+			pthread_mutex_unlock(&t->arena_lock);
+			/* the link keeps records 8-byte aligned, as the free list wants */
+			cls->bump     = block + sizeof(void *);
+			cls->bump_end = block + BLOB_ARENA_BLOCK;
+		}
+		rec = cls->bump;
+		cls->bump += size;
+	}
+	stripe_write_unlock(&cls->lock);
+	*(uint32_t *) rec = len;
+	return (unsigned char *) rec;
+}
+
+/* the length prefix tells the class, the record needs nothing else */
+static inline void blob_record_free(blob_table *t, unsigned char *rec) {
+
+	blob_class *cls = &t->classes[blob_class_of(*(uint32_t *) rec)];
+
+	stripe_write_lock(&cls->lock);
+	*(void **) rec = cls->free_list;
+	cls->free_list = rec;
+	stripe_write_unlock(&cls->lock);
+}
+
+static inline const unsigned char *blob_node_bytes(const blob_node *node) {
+	return (node->len <= BLOB_INLINE_LEN) ? node->bytes :\
+	       node->record + BLOB_RECORD_HDR;
+}
+
+/* a new node holding a copy of bytes, not linked yet */
+static inline blob_node *blob_node_make(blob_table *t, uint64_t key,\
+                                        const void *bytes, uint32_t len) {
+
+	blob_node *node = (blob_node *) slab_alloc(&t->node_slab);
+
+	if (!node) return NULL;
+	node->key = key;
+	node->len = len;
+	if (len <= BLOB_INLINE_LEN) {
+		memcpy(node->bytes, bytes, len);
+		return node;
+	}
+	if ((node->record = blob_record_alloc(t, len)) == NULL) {
+		slab_free(&t->node_slab, node);
+		return NULL;
+	}
+	memcpy(node->record + BLOB_RECORD_HDR, bytes, len);
+	return node;
+}
+
+/* EBR callback: a node unlinked by SET or DEL goes with its record */
+static void blob_free_node(void *ctx, void *ptr) {
+
+	blob_table *t = (blob_table *) ctx;
+	blob_node *node = (blob_node *) ptr;
+
+	if (node->len > BLOB_INLINE_LEN) blob_record_free(t, node->record);
+	slab_free(&t->node_slab, node);
+}
+
+/* EBR callback: an old chain copied over; the copies kept the records */
+static void blob_free_chain(void *ctx, void *ptr) {
+
+	blob_table *t = (blob_table *) ctx;
+	blob_node *node, *next;
+
+	for (node = (blob_node *) ptr; node; node = next) {
+		next = atomic_load_explicit(&node->next, memory_order_relaxed);
+		slab_free(&t->node_slab, node);
+	}
+}
+
+/* EBR callback: a migrated array, its chains retired one by one already */
+static void blob_free_buckets(void *ctx, void *ptr) {
+
+	(void) ctx;
+	free(ptr);
+}
+
+static inline void blob_table_free(blob_table *t) {
+
+	void *block;
+
+	/* nodes and arrays still waiting for readers to leave go first; the
+	 * nodes of the arrays go with the slab, their records with the blocks */
+	ebr_drain();
+	free(atomic_load(&t->buckets));
+	free(atomic_load(&t->old_buckets));
+	while ((block = t->blocks) != NULL) {
+		t->blocks = *(void **) block;
+		free(block);
+	}
+	slab_destroy(&t->node_slab);
+	pthread_mutex_destroy(&t->resize_lock);
+	pthread_mutex_destroy(&t->arena_lock);
+	free(t);
+}
+
+// bucket migration
+//
+// Copies the chain of one old bucket into the current array, with the
+// stripe both are in held. The old chain itself is never touched: a
+// lock-free reader walking it meanwhile still finds every entry, and
+// once the head says BLOB_MIGRATED it reads the new array, where later
+// changes of those keys go. Returns the old chain, for the caller to
+// retire once it has dropped the stripe, or NULL.
+//
+static inline blob_node *blob_migrate_bucket(blob_table *t, blob_buckets *old,\
+                                             blob_buckets *cur, uint64_t i) {
+
+	blob_node * _Atomic *head = &old->head[i], *node, *copy;
+	uintptr_t first = (uintptr_t) atomic_load_explicit(head,\
+	                                                   memory_order_relaxed);
+	uint64_t h;
+
+	if (first & BLOB_MIGRATED) return NULL;
+	for (node = (blob_node *) first; node;
+	     node = atomic_load_explicit(&node->next, memory_order_relaxed)) {
+		copy = (blob_node *) slab_alloc(&t->node_slab);
+		if (!copy) {perror("ERROR allocating blob table node"); exit(1);}
+		memcpy(copy, node, sizeof(blob_node));
+		h = hash_mask(hash_key64(node->key), cur->mask);
+		atomic_init(&copy->next, atomic_load_explicit(&cur->head[h],\
+		            memory_order_relaxed));
+		atomic_store_explicit(&cur->head[h], copy, memory_order_release);
+	}
+	atomic_store_explicit(head, (blob_node *) (first | BLOB_MIGRATED),\
+	                      memory_order_release);
+	return (blob_node *) first;
+}
+
+/* the few old buckets every SET and DEL copies, inside an EBR section */
+static inline void blob_migrate_step(blob_table *t) {
+
+	blob_buckets *old = atomic_load(&t->old_buckets), *cur;
+	blob_node *chain;
+	lock_stripe *stripe;
+	unsigned int n;
+	uint64_t i;
+
+	cur = atomic_load(&t->buckets);
+	if (!old || old == cur) return;
+	for (n = 0; n < BLOB_MIGRATE_PER_OP; n++) {
+		i = atomic_fetch_add(&old->migrate_next, 1);
+		if (i > old->mask) return;
+		stripe = &t->stripes[i & (BLOB_NUM_STRIPES - 1)];
+		stripe_write_lock(stripe);
+		chain = blob_migrate_bucket(t, old, cur, i);
+		stripe_write_unlock(stripe);
+		if (chain) ebr_retire(blob_free_chain, t, chain);
+		if (atomic_fetch_add(&old->migrated, 1) == old->mask) {
+			/* the last one: late readers may still walk the array */
+			pthread_mutex_lock(&t->resize_lock);
+			atomic_store(&t->old_buckets, NULL);
+			pthread_mutex_unlock(&t->resize_lock);
+			ebr_retire(blob_free_buckets, t, old);
+		}
+	}
+}
+
+// start growing the table
+//
+// Publishes the old array before the new one, as start_resize() does for
+// the 32-bit keys: anybody who sees the new array as current also sees
+// that old buckets have to be looked at. A table still migrating does
+// not grow again until it is done.
+//
+static inline void blob_table_grow(blob_table *t, blob_buckets *cur) {
+
+	blob_buckets *grown;
+
+	if (pthread_mutex_trylock(&t->resize_lock)) return;
+	if (atomic_load(&t->old_buckets) == NULL &&
+	    atomic_load(&t->buckets) == cur &&
+	    (grown = blob_buckets_create((cur->mask + 1) * 2)) != NULL) {
+		atomic_store(&t->old_buckets, cur);
+		atomic_store(&t->buckets, grown);
+	}
+	pthread_mutex_unlock(&t->resize_lock);
+}
+
+/* lock the stripe of key on the current array, inside an EBR read section,
+ * its old bucket copied over first; *link is where its node is, or where
+ * it would go */
+static inline lock_stripe *blob_lock_key(blob_table *t, uint64_t key,\
+                                         blob_buckets **cur,\
+                                         blob_node * _Atomic **link) {
+
+	blob_buckets *old;
+	blob_node *node, *chain = NULL;
+	lock_stripe *stripe;
+	uint64_t h = hash_key64(key);
+
+	stripe = &t->stripes[hash_mask(h, BLOB_NUM_STRIPES - 1)];
+	while (1) {
+		*cur = atomic_load(&t->buckets);
+		old  = atomic_load(&t->old_buckets);
+		stripe_write_lock(stripe);
+		if (*cur == atomic_load(&t->buckets) && (!old || old == *cur ||\
+		    !(chain = blob_migrate_bucket(t, old, *cur,\
+		                                  hash_mask(h, old->mask)))))
+			break;
+		/* grown meanwhile, or the old chain copied: retire it unlocked */
+		stripe_write_unlock(stripe);
+		if (chain) ebr_retire(blob_free_chain, t, chain);
+		chain = NULL;
+	}
+	for (*link = &(*cur)->head[hash_mask(h, (*cur)->mask)];
+	     (node = atomic_load_explicit(*link, memory_order_relaxed)) != NULL &&
+	     node->key != key;
+	     *link = &node->next)
+		;
+	return stripe;
+}
+
+/* the node of key in one array, NULL if missing or its bucket migrated */
+static inline blob_node *blob_find(blob_buckets *b, uint64_t h, uint64_t key) {
+
+	uintptr_t first = (uintptr_t) atomic_load_explicit(\
+	                  &b->head[hash_mask(h, b->mask)], memory_order_acquire);
+	blob_node *node;
+
+	if (first & BLOB_MIGRATED) return NULL;
+	for (node = (blob_node *) first; node && node->key != key;
+	     node = atomic_load_explicit(&node->next, memory_order_acquire))
+		;
+	return node;
+}
+
+// lock-free read
+//
+// Copies up to cap bytes of the value of key to buf and its whole length
+// to *len; false if key is missing. Old buckets first, as entries only
+// ever get copied from there to the current array; looks again if a
+// resize started or finished meanwhile.
+//
+static inline bool blob_table_get(blob_table *t, uint64_t key, void *buf,\
+                                  uint32_t cap, uint32_t *len) {
+
+	blob_buckets *cur, *old;
+	blob_node *node;
+	uint64_t h = hash_key64(key);
+
+	ebr_enter();
+	do {
+		cur  = atomic_load(&t->buckets);
+		old  = atomic_load(&t->old_buckets);
+		node = (old && old != cur) ? blob_find(old, h, key) : NULL;
+		if (!node) node = blob_find(cur, h, key);
+		if (node) {
+			*len = node->len;
+			memcpy(buf, blob_node_bytes(node), (node->len < cap) ? node->len : cap);
+		}
+	} while (cur != atomic_load(&t->buckets) ||
+	         old != atomic_load(&t->old_buckets));
+	ebr_exit();
+	return node != NULL;
+}
+
+/* cache mode: count a key about to be added, false if there is no room */
+static inline bool blob_reserve_entry(blob_table *t) {
+
+	if (atomic_fetch_add(&t->entries, 1) < t->max_entries) return true;
+	atomic_fetch_sub(&t->entries, 1);
+	return false;
+}
+
+/* insert or replace the value of key */
+static inline int blob_table_set(blob_table *t, uint64_t key, const void *bytes,\
+                                 uint32_t len) {
+
+	blob_buckets *cur;
+	blob_node * _Atomic *link, *node, *old;
+	lock_stripe *stripe;
+	bool grow;
+
+	if (len > BLOB_MAX_LEN) return BLOB_TOO_LONG;
+	/* copying the value is the slow part: done before taking the stripe */
+	if ((node = blob_node_make(t, key, bytes, len)) == NULL)
+		return BLOB_NO_MEMORY;
+
+	ebr_enter();
+	stripe = blob_lock_key(t, key, &cur, &link);
+	old    = atomic_load_explicit(link, memory_order_relaxed);
+	if (!old && t->max_entries && !blob_reserve_entry(t)) {
+		stripe_write_unlock(stripe);
+		ebr_exit();
+		blob_free_node(t, node);
+		return BLOB_FULL;
+	}
+	atomic_init(&node->next, old ? atomic_load_explicit(&old->next,\
+	            memory_order_relaxed) : NULL);
+	/* publish the fully initialized node to concurrent readers */
+	atomic_store_explicit(link, node, memory_order_release);
+	if (!old) stripe->count++;
+	grow = stripe->count > cur->stripe_limit;
+	stripe_write_unlock(stripe);
+
+	if (old) ebr_retire(blob_free_node, t, old);
+	if (grow) blob_table_grow(t, cur);
+	blob_migrate_step(t);
+	ebr_exit();
+	return old ? BLOB_UPDATED : BLOB_INSERTED;
+}
+
+/* false if key is missing */
+static inline bool blob_table_del(blob_table *t, uint64_t key) {
+
+	blob_buckets *cur;
+	blob_node * _Atomic *link, *node;
+	lock_stripe *stripe;
+
+	ebr_enter();
+	stripe = blob_lock_key(t, key, &cur, &link);
+	if ((node = atomic_load_explicit(link, memory_order_relaxed)) != NULL) {
+		atomic_store_explicit(link, atomic_load_explicit(&node->next,\
+		                      memory_order_relaxed), memory_order_release);
+		stripe->count--;
+		if (t->max_entries) atomic_fetch_sub(&t->entries, 1);
+	}
+	stripe_write_unlock(stripe);
+
+	if (node) ebr_retire(blob_free_node, t, node);
+	blob_migrate_step(t);
+	ebr_exit();
+	return node != NULL;
+}
+
+static inline size_t blob_table_count(blob_table *t) {
+
+	size_t count = 0;
+	unsigned int s;
+
+	for (s = 0; s < BLOB_NUM_STRIPES; s++) count += t->stripes[s].count;
+	return count;
+}
+
+#endif /* BLOB_TABLE_H */
@@ -1,4 +1,10 @@
+#define _GNU_SOURCE /* ppoll */
 #include "client_server.h"
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include "metrics.h"
 
 // Client-Server communication Protocol:
 //
@@ -8,7 +14,12 @@
 // 4. If key already exists in hash, CMD_STOR returns the bucket index of key.
 //
 // Compilation and test:
-//      $ gcc client.c -o client && ./client localhost 7861
+//      $ gcc client.c -o client -pthread -lm && ./client localhost 7861
+//      $ ./client -1 localhost 7861   (legacy hex protocol instead of v2)
+//      $ ./client -b 16 localhost 7861  (MSTOR / MRETR of 16 keys each)
+//      $ ./client -s localhost 7861     (print the server's STATS and exit)
+//      $ ./client -u localhost 7861     (UDP datagrams to a server with -u)
+//      $ ./client -L -t 4 -c 8 -p 16 -k zipf -P localhost 7861  (load generator)
 //
 //                                                                                
 // Client to Server message format
@@ -33,72 +44,378 @@
 //
 //    S - 0 (NO SUCCESS), 1 (SUCCESS)
 //
+// The v2 binary frame is described in client_server.h.
+//
+
+/* protocol the client speaks, PROTO_V2_BINARY unless -1 is given */
+static int proto = PROTO_V2_BINARY;
+
+/* keys per command, more than one sends MSTOR / MRETR (-b) */
+static unsigned int batch_size = 1;
+
+/* one datagram per request, to a server started with -u (-u); a request
+ * goes out again every UDP_RESEND_MS until it is answered */
+static bool udp = false;
+#define UDP_RESEND_MS          200
+#define UDP_MAX_SENDS          10
+
+/* only fetch and print the server metrics (-s) */
+static bool stats_only = false;
+static bool stats_table = false;   /* -D: STATS with the table spread */
+
+/* key distributions of the load generator */
+#define LOAD_DIST_UNIFORM      0
+#define LOAD_DIST_ZIPF         1
+#define LOAD_DIST_HOTSET       2
+
+#define LOAD_MAX_DEPTH         256  /* requests in flight per connection */
+#define LOAD_MAX_REQUEST_LEN   (PROTO_V2_FRAME_LEN + PROTO_MAX_BATCH *\
+                                PROTO_BATCH_ENTRY_LEN)
+
+/* load generator settings (-L and the options after it in usage) */
+typedef struct load_config_t {
+    bool          enabled;
+    unsigned int  threads;          /* -t */
+    unsigned int  conns;            /* -c, per thread */
+    unsigned int  depth;            /* -p, pipelined requests per connection */
+    unsigned int  duration_s;       /* -d */
+    double        rate;             /* -r, requests/s in total, 0: closed loop */
+    unsigned int  write_pct;        /* -w, share of STOR / MSTOR */
+    int           dist;             /* -k, LOAD_DIST_* */
+    double        zipf_theta;       /* -k zipf:theta */
+    double        hot_frac;         /* -k hot:fraction:probability */
+    double        hot_prob;
+    unsigned int  keys;             /* -K, size of the key space */
+    bool          preload;          /* -P, STOR every key before measuring */
+    const char   *csv;              /* -o, file to append a result row to */
+} load_config;
+
+static load_config load = { false, 1, 1, 1, 10, 0, 50, LOAD_DIST_UNIFORM,\
+                            0.99, 0.01, 0.9, MASK_KEY + 1, false, NULL };
+
+/* parse -k uniform | zipf[:theta] | hot[:fraction:probability] */
+static inline bool parse_key_distribution(const char *arg) {
 
-/* basic CLI validation */
-static inline void validate_input(int argc, char **argv) {
+    if (!strcmp(arg, "uniform")) {
+        load.dist = LOAD_DIST_UNIFORM;
+        return true;
+    }
+    if (!strncmp(arg, "zipf", 4)) {
+        load.dist = LOAD_DIST_ZIPF;
+        if (arg[4] == ':') load.zipf_theta = atof(arg + 5);
+        else if (arg[4]) return false;
+        return load.zipf_theta > 0 && load.zipf_theta < 1;
+    }
+    if (!strncmp(arg, "hot", 3)) {
+        load.dist = LOAD_DIST_HOTSET;
+        if (arg[3] == ':' &&\
+            sscanf(arg + 4, "%lf:%lf", &load.hot_frac, &load.hot_prob) != 2)
+            return false;
+        else if (arg[3] && arg[3] != ':') return false;
+        return load.hot_frac > 0 && load.hot_frac < 1 &&\
+               load.hot_prob >= 0 && load.hot_prob <= 1;
+    }
+    return false;
+}
+
+/* basic CLI validation; returns the index of the hostname argument */
+static inline int validate_input(int argc, char **argv) {
 
-    if (argc < 3) {
-       fprintf(stderr,"usage %s hostname port\n", argv[0]);
+    int opt;
+    bool bad = false;
+
+    while ((opt = getopt(argc, argv, "1b:sDuLt:c:p:d:r:w:k:K:Po:")) != -1) {
+       switch (opt) {
+       case '1':
+          proto = PROTO_V1_HEX;
+          break;
+       case 'b':
+          batch_size = atoi(optarg);
+          if (batch_size < 1 || batch_size > PROTO_MAX_BATCH) {
+             fprintf(stderr,"%s: -b takes 1 to %d keys\n", argv[0],\
+                     PROTO_MAX_BATCH);
+             exit(0);
+          }
+          break;
+       case 's':
+          stats_only = true;
+          break;
+       case 'D':
+          stats_only  = true;
+          stats_table = true;
+          break;
+       case 'u':
+          udp = true;
+          break;
+       case 'L':
+          load.enabled = true;
+          break;
+       case 't':
+          load.threads = atoi(optarg);
+          bad |= (load.threads < 1);
+          break;
+       case 'c':
+          load.conns = atoi(optarg);
+          bad |= (load.conns < 1);
+          break;
+       case 'p':
+          load.depth = atoi(optarg);
+          bad |= (load.depth < 1 || load.depth > LOAD_MAX_DEPTH);
+          break;
+       case 'd':
+          load.duration_s = atoi(optarg);
+          bad |= (load.duration_s < 1);
+          break;
+       case 'r':
+          load.rate = atof(optarg);
+          bad |= (load.rate < 0);
+          break;
+       case 'w':
+          load.write_pct = atoi(optarg);
+          bad |= (load.write_pct > 100);
+          break;
+       case 'k':
+          bad |= !parse_key_distribution(optarg);
+          break;
+       case 'K':
+          load.keys = strtoul(optarg, NULL, 0);
+          bad |= (load.keys < 1);
+          break;
+       case 'P':
+          load.preload = true;
+          break;
+       case 'o':
+          load.csv = optarg;
+          break;
+       default:
+          bad = true;
+          break;
+       }
+    }
+    /* legacy messages have a 16 bit key and no batches or STATS */
+    if (proto == PROTO_V1_HEX)
+       bad |= (batch_size > 1 || stats_only || load.keys > MASK_KEY + 1);
+    /* datagrams carry v2 frames, one request at a time */
+    if (udp) bad |= (proto == PROTO_V1_HEX || load.enabled);
+    if (bad || argc - optind < 2) {
+       fprintf(stderr,"usage %s [-1 | -b keys | -s | -D] [-u] hostname port\n"
+              "      %s -L [-t threads] [-c conns] [-p depth] [-d seconds]"
+              " [-r rate]\n"
+              "         [-w stor_percent] [-k uniform|zipf[:theta]|"
+              "hot[:fraction:prob]]\n"
+              "         [-K keys] [-P] [-o csv] [-1 | -b keys] hostname port\n",\
+              argv[0], argv[0]);
        exit(0);
     }
+    return optind;
 }
 
-/* setup TCP socket to server */
-static inline void setup_client_side_socket_parameters (int *sockfd, int portno,\
-                   char **argv, struct sockaddr_in serv_addr) {
+/* look the server up once, threads connect with the result */
+static inline void resolve_server (const char *host, int portno,\
+                                   struct sockaddr_in *serv_addr) {
 
     struct hostent *server;
 
-    /* basic socket client side setup */                                            
-    portno = atoi(argv[2]);
-    *sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (*sockfd < 0) 
-        error("ERROR opening socket");
-    server = gethostbyname(argv[1]);
+    server = gethostbyname(host);
     if (server == NULL) {
         fprintf(stderr,"ERROR, no such host\n");
         exit(0);
     }
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
+    bzero((char *) serv_addr, sizeof(*serv_addr));
+    serv_addr->sin_family = AF_INET;
     bcopy((char *)server->h_addr, 
-         (char *)&serv_addr.sin_addr.s_addr,
+         (char *)&serv_addr->sin_addr.s_addr,
          server->h_length);
-    serv_addr.sin_port = htons(portno);
-    if (connect(*sockfd,(struct sockaddr *) &serv_addr,sizeof(serv_addr)) < 0) 
+    serv_addr->sin_port = htons(portno);
+}
+
+/* setup TCP socket to server, or a UDP one only it can answer (-u) */
+static inline int connect_to_server (struct sockaddr_in *serv_addr) {
+
+    int sockfd;
+
+    /* basic socket client side setup */                                            
+    sockfd = socket(AF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if (sockfd < 0) 
+        error("ERROR opening socket");
+    if (connect(sockfd,(struct sockaddr *) serv_addr,sizeof(*serv_addr)) < 0) 
         error("ERROR connecting");
+    return sockfd;
+}
 
-    /* init seed for the random key to be searched/stored in hash */
-    srand(time(NULL));                                                    
+/* encode a request in the protocol of the connection; returns its length */
+static inline size_t encode_request (char *buffer, buffer_data *bdata) {
+
+    printf("\n(%d) cmd %d, key 0x%x, value, 0x%x", bdata->seq_num,\
+           bdata->opcode, bdata->key, bdata->value);
+    if (proto == PROTO_V2_BINARY) {
+        bdata->req_id = bdata->seq_num;
+        bdata->flags  = 0;
+        return encode_frame_to_message_buffer(buffer, bdata);
+    }
+    encode_key_value_to_message_buffer(buffer, bdata);
+    return CLIENT_TO_SERVER_MSG_LEN;
 }
 
 /* construct message to be sent to server over TCP socket -- for RETR */
-static inline void construct_RETR_command (char *buffer, buffer_data *bdata){
+static inline size_t construct_RETR_command (char *buffer, buffer_data *bdata){
 
     bdata->command = true; /* 0: STOR, 1: RETR */ 
+    bdata->opcode  = PROTO_OP_RETR;
     GET_RANDOM_KEY(bdata->key);	
     bdata->value = 0xdeadbeef;
     printf("\nRETR cmd from client to server: ");
-    encode_key_value_to_message_buffer(buffer, bdata);
+    return encode_request(buffer, bdata);
 }
 
 /* construct message to be sent to server over TCP socket -- for STOR */
-static void construct_STOR_command (char *buffer, buffer_data *bdata) {
+static size_t construct_STOR_command (char *buffer, buffer_data *bdata) {
 
     bdata->command = false; /* 0: STOR, 1: RETR */ 
+    bdata->opcode  = PROTO_OP_STOR;
     GET_RANDOM_KEY(bdata->key);	
     GET_RANDOM_VALUE(bdata->value);	
     printf("\nSTOR cmd from client to server: ");
-    encode_key_value_to_message_buffer(buffer, bdata);
+    return encode_request(buffer, bdata);
+}
+
+/* construct message to be sent to server over TCP socket -- for MSTOR / MRETR */
+static size_t construct_batch_command (char *buffer, buffer_data *bdata) {
+
+    unsigned int i;
+
+    bdata->command = rand() % NUM_COMMANDS_SUPPORTED; /* 0: MSTOR, 1: MRETR */
+    bdata->opcode  = bdata->command ? PROTO_OP_MRETR : PROTO_OP_MSTOR;
+    bdata->count   = batch_size;
+    bdata->key     = 0;
+    bdata->value   = 0;
+    for (i = 0; i < batch_size; i++) {
+        GET_RANDOM_KEY(bdata->entries[i].key);
+        GET_RANDOM_VALUE(bdata->entries[i].value);
+    }
+    printf("\n%s cmd of %u keys from client to server: ",\
+           bdata->command ? "MRETR" : "MSTOR", batch_size);
+    return encode_request(buffer, bdata);
+}
+
+/* read until one whole response is buffered, TCP may split it anywhere */
+static inline void read_response (int sockfd, char *buffer, buffer_data *bdata) {
+
+    size_t len = 0;
+    ssize_t n;
+    int stream_proto = proto;
+
+    while ((n = decode_message_from_stream(&stream_proto, buffer, len,\
+                                           bdata)) == 0) {
+        n = read(sockfd, buffer + len, PROTO_MAX_MSG_LEN - len);
+        if (n < 0) error("ERROR reading from socket");
+        if (n == 0) {
+            fprintf(stderr,"ERROR, server closed the connection\n");
+            exit(1);
+        }
+        len += n;
+    }
+    if (n < 0 || (stream_proto == PROTO_V2_BINARY &&\
+                  bdata->req_id != bdata->seq_num)) {
+        fprintf(stderr,"ERROR, malformed response from server\n");
+        exit(1);
+    }
+}
+
+// request over UDP (-u)
+//
+// The request is one datagram and so is its reply. Either may be lost, so
+// the request goes out again every UDP_RESEND_MS until a reply with its id
+// comes back into buffer; replies to an earlier request that came late
+// are skipped. A resent STOR may find its first copy already done.
+//
+static inline void exchange_datagram (int sockfd, char *buffer, size_t len,\
+                                      buffer_data *bdata) {
+
+    char request[PROTO_MAX_MSG_LEN];
+    struct pollfd pfd = { sockfd, POLLIN, 0 };
+    uint32_t req_id = bdata->req_id;
+    unsigned int sends;
+    int dgram_proto;
+    ssize_t n;
+
+    memcpy(request, buffer, len);
+    for (sends = 0; sends < UDP_MAX_SENDS; sends++) {
+        if (send(sockfd, request, len, 0) < 0 && errno != ECONNREFUSED)
+            error("ERROR writing to socket");
+        while (poll(&pfd, 1, UDP_RESEND_MS) > 0) {
+            /* no server on the port yet shows as ECONNREFUSED: resend */
+            if ((n = recv(sockfd, buffer, PROTO_MAX_MSG_LEN, 0)) < 0) {
+                if (errno != ECONNREFUSED && errno != EINTR)
+                    error("ERROR reading from socket");
+                continue;
+            }
+            dgram_proto = PROTO_V2_BINARY;
+            if (decode_message_from_stream(&dgram_proto, buffer, n, bdata) == n &&\
+                (bdata->flags & PROTO_FLAG_RESPONSE) && bdata->req_id == req_id)
+                return;
+        }
+    }
+    fprintf(stderr,"ERROR, no reply from server after %u tries\n", sends);
+    exit(1);
+}
+
+/* send a request and wait for its response, over TCP or UDP */
+static inline void send_request (int sockfd, char *buffer, size_t len,\
+                                 buffer_data *bdata) {
+
+    if (udp) {
+        exchange_datagram(sockfd, buffer, len, bdata);
+        return;
+    }
+    if (write(sockfd, buffer, len) < 0)
+        error("ERROR writing to socket");
+    CLEAR_SOCKET_BUFFER;
+    read_response(sockfd, buffer, bdata);
+}
+
+/* agree on the v2 protocol version before sending any command */
+static inline unsigned int negotiate_protocol_version (int sockfd) {
+
+    char buffer[PROTO_MAX_MSG_LEN];
+    buffer_data bdata = {0};
+
+    bdata.opcode = PROTO_OP_HELLO;
+    bdata.value  = PROTO_VERSION_MAX;
+    encode_frame_to_message_buffer(buffer, &bdata);
+    if (write(sockfd, buffer, PROTO_V2_FRAME_LEN) < 0)
+        error("ERROR writing to socket");
+    read_response(sockfd, buffer, &bdata);
+    if (bdata.status != CMD_SUCCESS) {
+        fprintf(stderr,"ERROR, server speaks no common protocol version\n");
+        exit(1);
+    }
+    return bdata.value;
+}
+
+/* ask for the server metrics and print them as they come */
+static inline void print_server_stats (int sockfd) {
+
+    char buffer[PROTO_MAX_MSG_LEN];
+    buffer_data bdata = {0};
+
+    bdata.opcode = PROTO_OP_STATS;
+    bdata.key    = stats_table ? PROTO_STATS_TABLE : 0;
+    encode_frame_to_message_buffer(buffer, &bdata);
+    send_request(sockfd, buffer, PROTO_V2_FRAME_LEN, &bdata);
+    printf("\n%.*s", (int) bdata.value, buffer + PROTO_V2_FRAME_LEN);
 }
 
 /* send command to server via TCP socket and parse server response */
 static inline void simulate_clients_send_sequential_cmds_to_server(int sockfd) {
 
-    unsigned int seq_num = 0, n;
-    char buffer[SOCKET_BUFFER_LEN];
+    unsigned int seq_num = 0, i, hits;
+    size_t len;
+    char buffer[PROTO_MAX_MSG_LEN];
+    batch_entry entries[PROTO_MAX_BATCH];
     buffer_data bdata;
 
+    bdata.entries = entries;
     while(1) {	
         /* sending client commands over TCP socket after delay of 1 second */
         sleep (1);
@@ -106,34 +423,479 @@ static inline void simulate_clients_send_sequential_cmds_to_server(int sockfd) {
         /* sending command from client to server */
         CLEAR_SOCKET_BUFFER;
         bdata.seq_num = seq_num++;
-        (rand()%NUM_COMMANDS_SUPPORTED) ?\
-            construct_STOR_command(buffer, &bdata):\
-            construct_RETR_command(buffer, &bdata);
-        n = write(sockfd,buffer,strlen(buffer));
-        if (n < 0) error("ERROR writing to socket");
-
-        /* receiving response from the server */
-        CLEAR_SOCKET_BUFFER;
-        n = read(sockfd,buffer,(SOCKET_BUFFER_LEN - 1));
-        if (n < 0) error("ERROR reading from socket");
+        if (batch_size > 1)
+            len = construct_batch_command(buffer, &bdata);
+        else
+            len = (rand()%NUM_COMMANDS_SUPPORTED) ?\
+                construct_STOR_command(buffer, &bdata):\
+                construct_RETR_command(buffer, &bdata);
         printf("\nResponse from server: ");
-	decode_key_value_from_message_buffer(buffer, &bdata);
+        send_request(sockfd, buffer, len, &bdata);
+        if (PROTO_IS_BATCH(bdata.opcode)) {
+            for (i = 0, hits = 0; i < bdata.count; i++) hits += entries[i].status;
+            printf("\n(%d) cmd %d, %u of %u keys succeeded", bdata.seq_num,\
+                   bdata.opcode, hits, bdata.count);
+        } else
+            printf("\n(%d) cmd %d key 0x%04x value 0x%08x", bdata.seq_num,\
+                   bdata.opcode, bdata.key, bdata.value);
         printf("\nResult seen by client %s",\
                  (bdata.status == CMD_SUCCESS) ? "SUCCESS" : "NO SUCCESS");
         printf("\n----------------------");
     }
 }
 
+// load generator
+//
+// Every thread drives its connections from one poll() loop, nonblocking,
+// with up to -p requests in flight on each. Closed loop (no -r) sends the
+// next request as soon as a response frees a slot. Open loop (-r) spaces
+// requests evenly at the given total rate; a request that cannot go out
+// on time because its connection is full goes out late but is still timed
+// from when it was due, so a slow server is not hidden by a slow client
+// (coordinated omission). Latencies go into the HDR histogram of
+// metrics.h, one per thread, merged at the end.
+//
+
+/* one connection of a load thread */
+typedef struct load_conn_t {
+    int             fd;
+    unsigned int    next_seq;        /* request id of the next request */
+    unsigned int    acked_seq;       /* request id of the next response */
+    uint64_t        next_due;        /* open loop: when the next one is due */
+    uint64_t        sent_at[LOAD_MAX_DEPTH];  /* by request id % depth */
+    unsigned char   sent_op[LOAD_MAX_DEPTH];
+    size_t          rlen, woff, wlen;
+    char            rbuf[2 * PROTO_MAX_MSG_LEN];
+    char           *wbuf;            /* depth requests of LOAD_MAX_REQUEST_LEN */
+} load_conn;
+
+typedef struct load_thread_t {
+    pthread_t       thread;
+    unsigned int    id;
+    load_conn      *conns;
+    uint64_t        rng;
+    unsigned int    preload_next;    /* keys of the key space to STOR first */
+    unsigned int    preload_end;
+    uint64_t        requests, keys, hits, misses;
+    uint64_t        hist[METRICS_HIST_BUCKETS];
+    uint64_t        max_ns;
+} load_thread;
+
+static pthread_barrier_t load_barrier;
+
+/* constants of the Zipfian generator, set up once by zipf_init() */
+static double zipf_zetan, zipf_alpha, zipf_eta;
+
+/* xorshift64*, per thread: rand() is neither fast nor thread-safe enough */
+static inline uint64_t load_random(load_thread *t) {
+
+    t->rng ^= t->rng >> 12;
+    t->rng ^= t->rng << 25;
+    t->rng ^= t->rng >> 27;
+    return t->rng * 0x2545F4914F6CDD1DULL;
+}
+
+/* uniform in [0, 1) */
+static inline double load_random_unit(load_thread *t) {
+
+    return (load_random(t) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Zipfian ranks
+//
+// The method of Gray et al., "Quickly generating billion-record synthetic
+// databases" (as used by YCSB): O(keys) setup, then O(1) per draw. Rank 0
+// is the most popular key.
+//
+static inline void zipf_init(unsigned int n, double theta) {
+
+    double zeta2 = 1 + pow(0.5, theta);
+    unsigned int i;
+
+    zipf_zetan = 0;
+    for (i = 1; i <= n; i++) zipf_zetan += 1 / pow(i, theta);
+    zipf_alpha = 1 / (1 - theta);
+    zipf_eta   = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zipf_zetan);
+}
+
+static inline unsigned int zipf_rank(load_thread *t) {
+
+    double u = load_random_unit(t), uz = u * zipf_zetan;
+    unsigned int rank;
+
+    if (uz < 1) return 0;
+    if (uz < 1 + pow(0.5, load.zipf_theta)) return 1;
+    rank = load.keys * pow(zipf_eta * u - zipf_eta + 1, zipf_alpha);
+    return (rank < load.keys) ? rank : load.keys - 1;
+}
+
+/* next key of the workload; ranks are scattered over the key space so the
+ * popular keys do not all sit in neighbouring buckets */
+static inline unsigned int load_next_key(load_thread *t) {
+
+    unsigned int rank, hot = load.keys * load.hot_frac;
+
+    switch (load.dist) {
+    case LOAD_DIST_ZIPF:
+        rank = zipf_rank(t);
+        break;
+    case LOAD_DIST_HOTSET:
+        if (hot < 1) hot = 1;
+        if (hot >= load.keys || load_random_unit(t) < load.hot_prob)
+            rank = load_random(t) % hot;
+        else
+            rank = hot + load_random(t) % (load.keys - hot);
+        break;
+    default:
+        return load_random(t) % load.keys;
+    }
+    return (uint32_t) ((uint64_t) rank * 2654435761u % load.keys);
+}
+
+/* encode the next request into the connection's send buffer */
+static inline void load_issue(load_thread *t, load_conn *c, uint64_t due) {
+
+    buffer_data bdata;
+    batch_entry entries[PROTO_MAX_BATCH];
+    char text[MESSAGE_BUFFER_SIZE];
+    unsigned int i, count = batch_size;
+    bool stor;
+
+    if (t->preload_next < t->preload_end) {
+        stor = true;
+        if (count > t->preload_end - t->preload_next)
+            count = t->preload_end - t->preload_next;
+    } else {
+        stor = load_random(t) % 100 < load.write_pct;
+    }
+    bdata.seq_num = bdata.req_id = c->next_seq;
+    bdata.command = stor ? CMD_STOR : CMD_RETR;
+    bdata.flags   = 0;
+    bdata.entries = entries;
+    if (batch_size > 1) {
+        bdata.opcode = stor ? PROTO_OP_MSTOR : PROTO_OP_MRETR;
+        bdata.count  = count;
+        bdata.key    = bdata.value = 0;
+        for (i = 0; i < count; i++) {
+            entries[i].key   = (t->preload_next < t->preload_end) ?\
+                               t->preload_next++ : load_next_key(t);
+            entries[i].value = load_random(t);
+        }
+    } else {
+        bdata.opcode = stor ? PROTO_OP_STOR : PROTO_OP_RETR;
+        bdata.key    = (t->preload_next < t->preload_end) ?\
+                       t->preload_next++ : load_next_key(t);
+        bdata.value  = stor ? (uint32_t) load_random(t) : 0xdeadbeef;
+    }
+
+    if (proto == PROTO_V2_BINARY) {
+        c->wlen += encode_frame_to_message_buffer(c->wbuf + c->wlen, &bdata);
+    } else {
+        /* snprintf() adds a NUL after the message */
+        encode_key_value_to_message_buffer(text, &bdata);
+        memcpy(c->wbuf + c->wlen, text, CLIENT_TO_SERVER_MSG_LEN);
+        c->wlen += CLIENT_TO_SERVER_MSG_LEN;
+    }
+    c->sent_at[c->next_seq % load.depth] = due;
+    c->sent_op[c->next_seq % load.depth] = bdata.opcode;
+    c->next_seq++;
+}
+
+/* push out what the socket takes; false if the connection is gone */
+static inline bool load_flush(load_conn *c) {
+
+    ssize_t n;
+
+    while (c->woff < c->wlen) {
+        n = send(c->fd, c->wbuf + c->woff, c->wlen - c->woff, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+        c->woff += n;
+    }
+    c->woff = c->wlen = 0;
+    return true;
+}
+
+/* read and account every complete response; false if the connection is gone */
+static inline bool load_receive(load_thread *t, load_conn *c, bool measure) {
+
+    buffer_data bdata;
+    batch_entry entries[PROTO_MAX_BATCH];
+    size_t off;
+    ssize_t n;
+    uint64_t now, ns;
+    unsigned int i, slot, hits;
+    int stream_proto = proto;
+
+    while (1) {
+        n = read(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen);
+        if (n == 0) return false;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+        c->rlen += n;
+        now = metrics_now();
+
+        for (off = 0; off < c->rlen; off += n) {
+            bdata.seq_num = c->acked_seq;
+            bdata.entries = entries;
+            n = decode_message_from_stream(&stream_proto, c->rbuf + off,\
+                                           c->rlen - off, &bdata);
+            if (n == 0) break;
+            if (n < 0 || c->acked_seq == c->next_seq ||\
+                bdata.req_id != c->acked_seq) {
+                fprintf(stderr,"ERROR, malformed response from server\n");
+                exit(1);
+            }
+            slot = c->acked_seq++ % load.depth;
+            if (!measure) continue;
+
+            ns = now - c->sent_at[slot];
+            t->hist[metrics_bucket(ns)]++;
+            if (ns > t->max_ns) t->max_ns = ns;
+            t->requests++;
+            switch (c->sent_op[slot]) {
+            case PROTO_OP_RETR:
+                t->keys++;
+                if (bdata.status) t->hits++; else t->misses++;
+                break;
+            case PROTO_OP_MRETR:
+                for (i = 0, hits = 0; i < bdata.count; i++)
+                    hits += entries[i].status;
+                t->keys   += bdata.count;
+                t->hits   += hits;
+                t->misses += bdata.count - hits;
+                break;
+            case PROTO_OP_MSTOR:
+                t->keys += bdata.count;
+                break;
+            default:
+                t->keys++;
+                break;
+            }
+        }
+        memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+        c->rlen -= off;
+    }
+}
+
+// one phase of a load thread
+//
+// Preload (measure false) STORs the thread's share of the key space at
+// full depth and returns when all of it is acknowledged. The measured
+// phase runs the workload until end.
+//
+static inline void load_run_phase(load_thread *t, struct pollfd *pfd,\
+                                  bool measure, uint64_t end) {
+
+    uint64_t now, interval = 0, wait;
+    unsigned int i, inflight;
+    load_conn *c;
+    struct timespec timeout;
+
+    if (measure && load.rate > 0) {
+        interval = 1e9 * load.threads * load.conns / load.rate;
+        /* stagger the connections over one interval */
+        for (i = 0, now = metrics_now(); i < load.conns; i++)
+            t->conns[i].next_due = now + interval *\
+                (t->id * load.conns + i) / (load.threads * load.conns);
+    }
+
+    while (1) {
+        now  = metrics_now();
+        wait = (end > now) ? end - now : 0;
+        for (i = 0, inflight = 0; i < load.conns; i++) {
+            c = &t->conns[i];
+            if (!measure) {
+                while (c->next_seq - c->acked_seq < load.depth &&\
+                       t->preload_next < t->preload_end)
+                    load_issue(t, c, now);
+            } else if (!interval) {
+                while (c->next_seq - c->acked_seq < load.depth)
+                    load_issue(t, c, now);
+            } else {
+                while (c->next_due <= now &&\
+                       c->next_seq - c->acked_seq < load.depth) {
+                    load_issue(t, c, c->next_due);
+                    c->next_due += interval;
+                }
+                if (c->next_seq - c->acked_seq < load.depth &&\
+                    c->next_due - now < wait)
+                    wait = c->next_due - now;
+            }
+            if (!load_flush(c)) error("ERROR writing to socket");
+            inflight += c->next_seq - c->acked_seq;
+            pfd[i].fd     = c->fd;
+            pfd[i].events = POLLIN | ((c->wlen > c->woff) ? POLLOUT : 0);
+        }
+        if (measure ? now >= end :\
+            (!inflight && t->preload_next == t->preload_end))
+            return;
+
+        timeout.tv_sec  = wait / 1000000000;
+        timeout.tv_nsec = wait % 1000000000;
+        if (ppoll(pfd, load.conns, &timeout, NULL) < 0 && errno != EINTR)
+            error("ERROR on poll");
+        for (i = 0; i < load.conns; i++) {
+            if ((pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) &&\
+                !load_receive(t, &t->conns[i], measure)) {
+                fprintf(stderr,"ERROR, server closed the connection\n");
+                exit(1);
+            }
+        }
+    }
+}
+
+void * load_thread_main (void * arg) {
+
+    load_thread *t = (load_thread *) arg;
+    struct pollfd *pfd = (struct pollfd *) calloc(load.conns, sizeof(*pfd));
+    uint64_t end;
+
+    if (!pfd) error("ERROR allocating poll set");
+    if (load.preload) load_run_phase(t, pfd, false, UINT64_MAX);
+    t->preload_next = t->preload_end;
+
+    /* everybody starts measuring at the same time, after the preload */
+    pthread_barrier_wait(&load_barrier);
+    end = metrics_now() + load.duration_s * 1000000000ULL;
+    load_run_phase(t, pfd, true, end);
+    free(pfd);
+    return NULL;
+}
+
+/* summary on stdout, and one CSV row if asked for */
+static inline void load_report(load_thread *threads, double seconds) {
+
+    static uint64_t hist[METRICS_HIST_BUCKETS];
+    static const char *dist_names[] = { "uniform", "zipf", "hot" };
+    uint64_t requests = 0, keys = 0, hits = 0, misses = 0, max_ns = 0;
+    double p50, p99, p999;
+    unsigned int i, b;
+    FILE *csv;
+
+    for (i = 0; i < load.threads; i++) {
+        requests += threads[i].requests;
+        keys     += threads[i].keys;
+        hits     += threads[i].hits;
+        misses   += threads[i].misses;
+        if (threads[i].max_ns > max_ns) max_ns = threads[i].max_ns;
+        for (b = 0; b < METRICS_HIST_BUCKETS; b++)
+            hist[b] += threads[i].hist[b];
+    }
+    p50  = metrics_percentile(hist, requests, 500) / 1e3;
+    p99  = metrics_percentile(hist, requests, 990) / 1e3;
+    p999 = metrics_percentile(hist, requests, 999) / 1e3;
+
+    printf("load: %u threads x %u connections, %s, depth %u, %u%% STOR, "
+           "%s over %u keys, %u keys per request\n", load.threads, load.conns,
+           (load.rate > 0) ? "open loop" : "closed loop", load.depth,
+           load.write_pct, dist_names[load.dist], load.keys, batch_size);
+    printf("requests %llu in %.2f s: %.1f requests/s, %.1f keys/s\n",\
+           (unsigned long long) requests, seconds, requests / seconds,\
+           keys / seconds);
+    printf("hits %llu misses %llu\n", (unsigned long long) hits,\
+           (unsigned long long) misses);
+    printf("latency us: p50 %.1f p99 %.1f p99.9 %.1f max %.1f\n",\
+           p50, p99, p999, max_ns / 1e3);
+
+    if (!load.csv) return;
+    if ((csv = fopen(load.csv, "a")) == NULL) error("ERROR opening CSV file");
+    if (ftell(csv) == 0)
+        fprintf(csv, "threads,conns,depth,rate,stor_pct,dist,keys,batch,"
+                     "seconds,requests,requests_per_s,keys_per_s,hits,misses,"
+                     "p50_us,p99_us,p999_us,max_us\n");
+    fprintf(csv, "%u,%u,%u,%.0f,%u,%s,%u,%u,%.3f,%llu,%.1f,%.1f,%llu,%llu,"
+                 "%.1f,%.1f,%.1f,%.1f\n", load.threads, load.conns, load.depth,
+            load.rate, load.write_pct, dist_names[load.dist], load.keys,
+            batch_size, seconds, (unsigned long long) requests,
+            requests / seconds, keys / seconds, (unsigned long long) hits,
+            (unsigned long long) misses, p50, p99, p999, max_ns / 1e3);
+    fclose(csv);
+}
+
+/* connect everything, run the threads and report */
+static inline void generate_load(struct sockaddr_in *serv_addr) {
+
+    load_thread *threads;
+    load_conn *c;
+    unsigned int i, j, share;
+    uint64_t start;
+
+    threads = (load_thread *) calloc(load.threads, sizeof(load_thread));
+    if (!threads) error("ERROR allocating load threads");
+    if (load.dist == LOAD_DIST_ZIPF) zipf_init(load.keys, load.zipf_theta);
+    pthread_barrier_init(&load_barrier, NULL, load.threads + 1);
+
+    share = (load.keys + load.threads - 1) / load.threads;
+    for (i = 0; i < load.threads; i++) {
+        threads[i].id  = i;
+        threads[i].rng = (time(NULL) * 0x9E3779B97F4A7C15ULL) ^ (i + 1);
+        threads[i].preload_next = (i * share < load.keys) ? i * share : load.keys;
+        threads[i].preload_end  = ((i + 1) * share < load.keys) ?\
+                                  (i + 1) * share : load.keys;
+        threads[i].conns = (load_conn *) calloc(load.conns, sizeof(load_conn));
+        if (!threads[i].conns) error("ERROR allocating connections");
+        for (j = 0; j < load.conns; j++) {
+            c = &threads[i].conns[j];
+            c->fd   = connect_to_server(serv_addr);
+            c->wbuf = (char *) malloc(load.depth * LOAD_MAX_REQUEST_LEN);
+            if (!c->wbuf) error("ERROR allocating send buffer");
+            if (proto == PROTO_V2_BINARY) negotiate_protocol_version(c->fd);
+            if (fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK) < 0)
+                error("ERROR setting O_NONBLOCK");
+        }
+    }
+    for (i = 0; i < load.threads; i++) {
+        if (pthread_create(&threads[i].thread, NULL, load_thread_main,\
+                           &threads[i]))
+            error("ERROR creating load thread");
+    }
+
+    pthread_barrier_wait(&load_barrier);
+    start = metrics_now();
+    for (i = 0; i < load.threads; i++) pthread_join(threads[i].thread, NULL);
+    load_report(threads, (metrics_now() - start) / 1e9);
+
+    for (i = 0; i < load.threads; i++) {
+        for (j = 0; j < load.conns; j++) {
+            close(threads[i].conns[j].fd);
+            free(threads[i].conns[j].wbuf);
+        }
+        free(threads[i].conns);
+    }
+    free(threads);
+}
+
 /* main driver function for client */
 int main(int argc, char *argv[])
 {
-    int sockfd, portno;
+    int sockfd, host;
     struct sockaddr_in serv_addr;
 
     /* client operation */
-    validate_input(argc, argv);
-    setup_client_side_socket_parameters (&sockfd, portno, argv, serv_addr);
-    simulate_clients_send_sequential_cmds_to_server(sockfd);
+    host = validate_input(argc, argv);
+    resolve_server(argv[host], atoi(argv[host + 1]), &serv_addr);
+
+    /* init seed for the random key to be searched/stored in hash */
+    srand(time(NULL));
+    if (load.enabled) {
+        generate_load(&serv_addr);
+        return 0;
+    }
+
+    sockfd = connect_to_server(&serv_addr);
+    /* a datagram needs no HELLO first */
+    if (proto == PROTO_V2_BINARY && !udp)
+        printf("\nprotocol version %u agreed with server",\
+               negotiate_protocol_version(sockfd));
+    if (stats_only)
+        print_server_stats(sockfd);
+    else
+        simulate_clients_send_sequential_cmds_to_server(sockfd);
 
     close(sockfd);
     return 0;
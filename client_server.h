@@ -1,6 +1,7 @@
 #include <stdio.h> 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
@@ -33,6 +34,88 @@
 //
 //    S - 0 (NO SUCCESS), 1 (SUCCESS)
 //
+// The above is the legacy (v1) protocol, 16 hex characters per message.
+//
+// v2 binary frame, requests and responses alike, integers little-endian
+//
+//      0        1        2        3
+//    +--------+--------+--------+--------+
+//    | magic  | opcode | flags  | status |
+//    +--------+--------+--------+--------+
+//    |            request id             |
+//    +-----------------------------------+
+//    |                key                |
+//    +-----------------------------------+
+//    |          value or bucket index    |
+//    +-----------------------------------+
+//
+//    magic  - PROTO_V2_MAGIC, never a hex digit, so the first byte of a
+//             connection tells the two protocols apart
+//    opcode - PROTO_OP_STOR, PROTO_OP_RETR, PROTO_OP_MSTOR, PROTO_OP_MRETR,
+//             PROTO_OP_DEL, PROTO_OP_UPSERT, PROTO_OP_CAS, PROTO_OP_STATS
+//             or PROTO_OP_HELLO; v3 adds PROTO_OP_BSET, PROTO_OP_BGET and
+//             PROTO_OP_BDEL
+//    flags  - PROTO_FLAG_RESPONSE on responses, other bits are echoed
+//    status - 0 (NO SUCCESS), 1 (SUCCESS); 0 in requests
+//
+// Batch opcodes (MSTOR, MRETR) carry the number of entries, 1 up to
+// PROTO_MAX_BATCH, in the key field and the entries right after the frame:
+//
+//    MSTOR request   count x { key, value }
+//    MRETR request   count x { key }
+//    response        count x { status, value }, status of the frame is
+//                    SUCCESS only if every entry succeeded
+//
+// STOR only adds a key that is missing: the first value stored stays.
+// UPSERT sets the value whether the key is there or not, DEL removes the
+// key and answers with the value it had. CAS carries the value it
+// expects in the frame and the value to put in its place right after
+// it, PROTO_CAS_PAYLOAD_LEN bytes; it succeeds only if the key holds the
+// expected value, and its response is a bare frame. All three are v2
+// only.
+//
+// A STOR or UPSERT request with PROTO_FLAG_TTL set carries a time to live
+// in seconds right after the frame, PROTO_TTL_PAYLOAD_LEN bytes: the key
+// reads as missing once it has passed, and the server reclaims it soon
+// after. A later UPSERT without the flag keeps the key for good, a TTL of
+// 0 is no TTL.
+//
+// A STATS request is a bare frame. Its response carries in value the
+// length of the text that follows the frame, at most PROTO_MAX_STATS_LEN
+// bytes of "name value" lines with the server's counters and latency
+// percentiles. With PROTO_STATS_TABLE in the key field it also reports
+// how evenly the table spreads its keys; that walks the whole table.
+//
+// A v2 client opens with PROTO_OP_HELLO carrying in value the highest
+// version it speaks; the server answers with the version both will use,
+// or NO SUCCESS if there is none. Responses come back in request order
+// and echo the request id, so clients may pipeline.
+//
+// v3 is v2 plus a second keyspace of 64-bit keys with byte string values,
+// apart from the 32-bit one; a connection has it once HELLO agreed on 3.
+// Its requests carry the key and the value length right after the frame,
+// PROTO_BLOB_HDR_LEN bytes, and the value, if any, after that:
+//
+//    BSET request    { key (8 bytes), length }, value; sets the value
+//                    whether the key is there or not
+//    BGET request    { key, 0 }
+//    BDEL request    { key, 0 }, removes the key
+//    BGET response   the length in value, the value after the frame
+//    BSET, BDEL      bare frame
+//
+// Values are byte strings of 0 to PROTO_MAX_VALUE_LEN (1024) bytes: a
+// request with a longer one is malformed and closes the connection. The
+// key and value fields of a request frame are not used. A server with
+// -W answers BSET and BDEL with NO SUCCESS, it cannot make them durable.
+//
+// A server started with -u also takes requests as UDP datagrams on its
+// port, one v2 frame with its payload per datagram, and answers each
+// with one. There is no HELLO to send first, v3 opcodes included, and
+// replies come in any order: clients match them by request id. A
+// malformed request gets no reply, and any reply may be lost, so the
+// client resends after a timeout; a resent STOR or DEL may find its first
+// copy already done.
+//
 
 
 /* all sizes and lengths in bytes */
@@ -40,6 +123,8 @@
 #define SOCKET_BUFFER_LEN          68
 #define CLIENT_TO_SERVER_MSG_SIZE  8
 #define SERVER_TO_CLIENT_MSG_SIZE  8
+#define CLIENT_TO_SERVER_MSG_LEN   16 /* encoded "%d000%04x%08x" text on the wire */
+#define SERVER_TO_CLIENT_MSG_LEN   16
 #define HASH_KEY_SIZE              16
 #define HASH_VAL_SIZE              32
 #define HASH_KEY_OFFSET            16
@@ -55,6 +140,43 @@
 #define VAL_OFFSET_IN_MSG 8
 #define MSG_ENCODING_BASE 16
 
+/* v2 binary protocol, see the frame layout above */
+#define PROTO_V2_MAGIC       0xB2
+#define PROTO_V2_FRAME_LEN   16
+#define PROTO_MAX_BATCH      64 /* entries in one MSTOR / MRETR */
+#define PROTO_BATCH_ENTRY_LEN 8 /* half of it for an MRETR request */
+#define PROTO_CAS_PAYLOAD_LEN 4 /* the new value, after a CAS request */
+#define PROTO_TTL_PAYLOAD_LEN 4 /* seconds, after a STOR / UPSERT request */
+#define PROTO_MAX_STATS_LEN  2048 /* text after a STATS response */
+#define PROTO_BLOB_HDR_LEN   12 /* key and length, after a v3 request */
+#define PROTO_MAX_VALUE_LEN  1024 /* of a v3 value, a few fit in a wbuf */
+#define PROTO_MAX_MSG_LEN    (PROTO_V2_FRAME_LEN + PROTO_MAX_STATS_LEN) /* of\
+                              either protocol, more than a full batch */
+#define PROTO_OP_STOR        0  /* same as CMD_STOR */
+#define PROTO_OP_RETR        1  /* same as CMD_RETR */
+#define PROTO_OP_MSTOR       2
+#define PROTO_OP_MRETR       3
+#define PROTO_OP_DEL         4
+#define PROTO_OP_UPSERT      5
+#define PROTO_OP_CAS         6
+#define PROTO_OP_STATS       0x10
+#define PROTO_OP_BSET        0x20 /* v3 only */
+#define PROTO_OP_BGET        0x21
+#define PROTO_OP_BDEL        0x22
+#define PROTO_OP_HELLO       0x7F
+#define PROTO_STATS_TABLE    1  /* STATS key: add the table spread */
+#define PROTO_IS_BATCH(op)   ((op) == PROTO_OP_MSTOR || (op) == PROTO_OP_MRETR)
+#define PROTO_IS_BLOB(op)    ((op) >= PROTO_OP_BSET && (op) <= PROTO_OP_BDEL)
+#define PROTO_FLAG_RESPONSE  0x80
+#define PROTO_FLAG_TTL       0x01 /* STOR / UPSERT request carries a TTL */
+
+/* protocol spoken on a connection, numbered after its version */
+#define PROTO_UNKNOWN        0
+#define PROTO_V1_HEX         1
+#define PROTO_V2_BINARY      2
+#define PROTO_V3_BINARY      3  /* v2 frames, agreed on by HELLO */
+#define PROTO_VERSION_MAX    PROTO_V3_BINARY
+
 /* Commands implemented in Server and possible results */
 #define CMD_STOR             0
 #define CMD_RETR             1
@@ -72,10 +194,28 @@ typedef struct buffer_data_t {
                 bool command; /* C bit indicating command: STOR / RETR */
                 bool status;  /* S bit indicating result: SUCCESS / NO SUCCESS */
         };      
-        unsigned short int key; /* considering 16 bit search key */
+        unsigned int key;       /* 16 bit search key in v1, 32 bit in v2 */
         unsigned int value; 
+        unsigned int req_id;    /* v2 only, echoed in the response */
+        unsigned char opcode;   /* v2 only, PROTO_OP_* */
+        unsigned char flags;    /* v2 only, PROTO_FLAG_* */
+        unsigned int count;     /* v2 batch only, number of entries */
+        unsigned int swap;      /* v2 CAS only, replaces value if it matches */
+        unsigned int ttl;       /* v2 STOR / UPSERT with PROTO_FLAG_TTL, seconds */
+        struct batch_entry_t *entries; /* v2 batch only, caller's storage */
+        uint64_t key64;         /* v3 only, key of the 64-bit keyspace */
+        unsigned int blob_len;  /* v3 only, bytes of value in blob */
+        unsigned char *blob;    /* v3 only, caller's storage of
+                                 * PROTO_MAX_VALUE_LEN bytes */
 } buffer_data;
 
+/* one key of an MSTOR / MRETR, with its result */
+typedef struct batch_entry_t {
+        unsigned int key;
+        unsigned int value;
+        bool status;
+} batch_entry;
+
 /* handle basic errors during socket operations */
 void error(const char *msg)
 {
@@ -93,8 +233,6 @@ static inline void encode_key_value_to_message_buffer(char *buffer,\
 
     snprintf(buffer, MESSAGE_BUFFER_SIZE, "%d000%04x%08x",\
              bdata->command, bdata->key, bdata->value);
-    printf("\n(%d) cmd %d, key 0x%x, value, 0x%x",\
-             bdata->seq_num, bdata->command, bdata->key, bdata->value);
 }
 
 /* 
@@ -120,6 +258,223 @@ static inline void decode_key_value_from_message_buffer(char *buffer,\
     bdata->command = (buffer[0] == '1') ? true : false;
     bdata->key = (unsigned int) strtol(server_key, NULL, MSG_ENCODING_BASE);
     bdata->value  = (unsigned int) strtol(server_val, NULL, MSG_ENCODING_BASE);
-    printf("\n(%d) cmd %d key 0x%04x value 0x%08x",\
-            bdata->seq_num, bdata->command, bdata->key, bdata->value);
+}
+
+static inline void put_le32(unsigned char *p, uint32_t v) {
+
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static inline uint32_t get_le32(const unsigned char *p) {
+
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 |\
+           (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static inline void put_le64(unsigned char *p, uint64_t v) {
+
+    put_le32(p, (uint32_t) v);
+    put_le32(p + 4, (uint32_t) (v >> 32));
+}
+
+static inline uint64_t get_le64(const unsigned char *p) {
+
+    return (uint64_t) get_le32(p) | (uint64_t) get_le32(p + 4) << 32;
+}
+
+/* length of the entries, CAS value, TTL or v3 value following a frame;
+ * count is the value length of a v3 opcode */
+static inline size_t batch_payload_len(unsigned char opcode, unsigned char flags,\
+                                       unsigned int count) {
+
+    if (PROTO_IS_BLOB(opcode))
+        return ((flags & PROTO_FLAG_RESPONSE) ? 0 : PROTO_BLOB_HDR_LEN) + count;
+    if (opcode == PROTO_OP_CAS)
+        return (flags & PROTO_FLAG_RESPONSE) ? 0 : PROTO_CAS_PAYLOAD_LEN;
+    if (opcode == PROTO_OP_STOR || opcode == PROTO_OP_UPSERT)
+        return ((flags & (PROTO_FLAG_TTL | PROTO_FLAG_RESPONSE)) ==\
+                PROTO_FLAG_TTL) ? PROTO_TTL_PAYLOAD_LEN : 0;
+    if (!PROTO_IS_BATCH(opcode)) return 0;
+    if (opcode == PROTO_OP_MRETR && !(flags & PROTO_FLAG_RESPONSE))
+        return count * PROTO_BATCH_ENTRY_LEN / 2;
+    return count * PROTO_BATCH_ENTRY_LEN;
+}
+
+/* 
+ * API to encode a v2 binary frame, request or response by PROTO_FLAG_RESPONSE
+ *      input:  opcode, flags, request id, key, value, status, batch entries
+ *      output: the frame and its entries in message buffer, returns the length
+ */
+static inline size_t encode_frame_to_message_buffer(char *buffer,\
+                                                    buffer_data *bdata) {
+
+    unsigned char *p = (unsigned char *) buffer;
+    bool response = bdata->flags & PROTO_FLAG_RESPONSE;
+    unsigned int i;
+
+    p[0] = PROTO_V2_MAGIC;
+    p[1] = bdata->opcode;
+    p[2] = bdata->flags;
+    p[3] = response ? bdata->status : 0;
+    put_le32(p + 4, bdata->req_id);
+    put_le32(p + 8, PROTO_IS_BATCH(bdata->opcode) ? bdata->count : bdata->key);
+    put_le32(p + 12, bdata->value);
+    if (PROTO_IS_BLOB(bdata->opcode)) {
+        p += PROTO_V2_FRAME_LEN;
+        if (!response) {
+            put_le64(p, bdata->key64);
+            put_le32(p + 8, bdata->blob_len);
+            p += PROTO_BLOB_HDR_LEN;
+        }
+        if (bdata->blob_len) memcpy(p, bdata->blob, bdata->blob_len);
+        return PROTO_V2_FRAME_LEN +\
+               batch_payload_len(bdata->opcode, bdata->flags, bdata->blob_len);
+    }
+    if (bdata->opcode == PROTO_OP_CAS && !response) {
+        put_le32(p + PROTO_V2_FRAME_LEN, bdata->swap);
+        return PROTO_V2_FRAME_LEN + PROTO_CAS_PAYLOAD_LEN;
+    }
+    if (batch_payload_len(bdata->opcode, bdata->flags, 0) ==\
+        PROTO_TTL_PAYLOAD_LEN) {
+        put_le32(p + PROTO_V2_FRAME_LEN, bdata->ttl);
+        return PROTO_V2_FRAME_LEN + PROTO_TTL_PAYLOAD_LEN;
+    }
+    if (!PROTO_IS_BATCH(bdata->opcode)) return PROTO_V2_FRAME_LEN;
+
+    for (i = 0, p += PROTO_V2_FRAME_LEN; i < bdata->count; i++) {
+        if (response) {
+            put_le32(p, bdata->entries[i].status);
+            put_le32(p + 4, bdata->entries[i].value);
+            p += 8;
+        } else {
+            put_le32(p, bdata->entries[i].key);
+            p += 4;
+            if (bdata->opcode == PROTO_OP_MSTOR) {
+                put_le32(p, bdata->entries[i].value);
+                p += 4;
+            }
+        }
+    }
+    return PROTO_V2_FRAME_LEN +\
+           batch_payload_len(bdata->opcode, bdata->flags, bdata->count);
+}
+
+/* 
+ * API to decode the next message from a byte stream of either protocol
+ *      input:  bytes received so far, *proto (PROTO_UNKNOWN until the
+ *              first byte has been seen, then pinned for the stream)
+ *      output: one message in bdata, batch entries in bdata->entries;
+ *              returns the bytes it took, 0 if the buffer ends inside
+ *              the message, -1 on malformed input
+ */
+static inline ssize_t decode_message_from_stream(int *proto, const char *buffer,\
+                                                 size_t len, buffer_data *bdata) {
+
+    const unsigned char *p = (const unsigned char *) buffer;
+    size_t payload = 0;
+    unsigned int i;
+
+    if (len == 0) return 0;
+    if (*proto == PROTO_UNKNOWN)
+        *proto = (p[0] == PROTO_V2_MAGIC) ? PROTO_V2_BINARY : PROTO_V1_HEX;
+
+    if (*proto == PROTO_V1_HEX) {
+        if (len < CLIENT_TO_SERVER_MSG_LEN) return 0;
+        decode_key_value_from_message_buffer((char *) buffer, bdata);
+        bdata->opcode = bdata->command;
+        bdata->flags  = 0;
+        bdata->ttl    = 0;
+        bdata->req_id = bdata->seq_num;
+        return CLIENT_TO_SERVER_MSG_LEN;
+    }
+
+    if (len < PROTO_V2_FRAME_LEN) return 0;
+    if (p[0] != PROTO_V2_MAGIC) return -1;
+    if (p[1] != PROTO_OP_STOR && p[1] != PROTO_OP_RETR &&\
+        !PROTO_IS_BATCH(p[1]) && p[1] != PROTO_OP_DEL &&\
+        p[1] != PROTO_OP_UPSERT && p[1] != PROTO_OP_CAS &&\
+        p[1] != PROTO_OP_STATS && p[1] != PROTO_OP_HELLO &&\
+        !PROTO_IS_BLOB(p[1]))
+        return -1;
+    if (PROTO_IS_BLOB(p[1])) {
+        if (*proto < PROTO_V3_BINARY || !bdata->blob) return -1;
+        if (p[2] & PROTO_FLAG_RESPONSE) {
+            bdata->blob_len = get_le32(p + 12);
+        } else {
+            if (len < PROTO_V2_FRAME_LEN + PROTO_BLOB_HDR_LEN) return 0;
+            bdata->blob_len = get_le32(p + PROTO_V2_FRAME_LEN + 8);
+            if (p[1] != PROTO_OP_BSET && bdata->blob_len) return -1;
+        }
+        if (bdata->blob_len > PROTO_MAX_VALUE_LEN) return -1;
+        payload = batch_payload_len(p[1], p[2], bdata->blob_len);
+        if (len < PROTO_V2_FRAME_LEN + payload) return 0;
+    } else if (!PROTO_IS_BATCH(p[1])) {
+        payload = batch_payload_len(p[1], p[2], 0);
+        if (len < PROTO_V2_FRAME_LEN + payload) return 0;
+    }
+    if (PROTO_IS_BATCH(p[1])) {
+        bdata->count = get_le32(p + 8);
+        if (bdata->count == 0 || bdata->count > PROTO_MAX_BATCH ||\
+            !bdata->entries)
+            return -1;
+        payload = batch_payload_len(p[1], p[2], bdata->count);
+        if (len < PROTO_V2_FRAME_LEN + payload) return 0;
+    }
+    if (p[1] == PROTO_OP_STATS && (p[2] & PROTO_FLAG_RESPONSE)) {
+        /* the text is left in place, right after the frame */
+        if (get_le32(p + 12) > PROTO_MAX_STATS_LEN) return -1;
+        if (len < PROTO_V2_FRAME_LEN + get_le32(p + 12)) return 0;
+        bdata->opcode = p[1];
+        bdata->flags  = p[2];
+        bdata->status = p[3];
+        bdata->req_id = get_le32(p + 4);
+        bdata->key    = get_le32(p + 8);
+        bdata->value  = get_le32(p + 12);
+        return PROTO_V2_FRAME_LEN + bdata->value;
+    }
+    bdata->opcode = p[1];
+    bdata->flags  = p[2];
+    if (bdata->flags & PROTO_FLAG_RESPONSE)
+        bdata->status  = p[3];
+    else
+        bdata->command = (p[1] == PROTO_OP_RETR || p[1] == PROTO_OP_MRETR);
+    bdata->req_id = get_le32(p + 4);
+    bdata->key    = get_le32(p + 8);
+    bdata->value  = get_le32(p + 12);
+    bdata->ttl    = 0;
+    if (!payload) return PROTO_V2_FRAME_LEN;
+    if (PROTO_IS_BLOB(bdata->opcode)) {
+        p += PROTO_V2_FRAME_LEN;
+        if (!(bdata->flags & PROTO_FLAG_RESPONSE)) {
+            bdata->key64 = get_le64(p);
+            p += PROTO_BLOB_HDR_LEN;
+        }
+        memcpy(bdata->blob, p, bdata->blob_len);
+        return PROTO_V2_FRAME_LEN + payload;
+    }
+    if (bdata->opcode == PROTO_OP_CAS) {
+        bdata->swap = get_le32(p + PROTO_V2_FRAME_LEN);
+        return PROTO_V2_FRAME_LEN + payload;
+    }
+    if (!PROTO_IS_BATCH(bdata->opcode)) {
+        bdata->ttl = get_le32(p + PROTO_V2_FRAME_LEN);
+        return PROTO_V2_FRAME_LEN + payload;
+    }
+
+    for (i = 0, p += PROTO_V2_FRAME_LEN; i < bdata->count; i++) {
+        if (bdata->flags & PROTO_FLAG_RESPONSE) {
+            bdata->entries[i].status = get_le32(p);
+            bdata->entries[i].value  = get_le32(p + 4);
+            p += 8;
+        } else {
+            bdata->entries[i].key   = get_le32(p);
+            bdata->entries[i].value = 0;
+            p += 4;
+            if (bdata->opcode == PROTO_OP_MSTOR) {
+                bdata->entries[i].value = get_le32(p);
+                p += 4;
+            }
+        }
+    }
+    return PROTO_V2_FRAME_LEN + payload;
 }
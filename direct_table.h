@@ -0,0 +1,259 @@
+#ifndef DIRECT_TABLE_H
+#define DIRECT_TABLE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lock_stripe.h"
+#include "timer_wheel.h"
+
+//
+// Direct-indexed table for key domains of 16 bits or less.
+//
+// One slot per possible key, indexed by the key itself: no hash, no
+// probing, no chain. A slot is a single 64-bit word, the value in its low
+// half and the state in its high half: DIRECT_STATE_EMPTY, DIRECT_STATE_LIVE
+// for a key without expiry, or else its expiry time in unix seconds. The
+// state doubles as the presence bit, and because value, presence and
+// expiry change together with one atomic operation:
+//
+//    RETR     one acquire load
+//    STOR     one CAS from a missing or expired word
+//    UPSERT   one exchange
+//    CAS      one CAS from the word holding the expected value
+//    DEL      one exchange to DIRECT_STATE_EMPTY
+//
+// No operation takes a lock and nothing is ever freed, so readers need
+// no EBR section either. A key outside the domain is never stored and
+// reads as missing.
+//
+// With max_entries set the table is a cache: direct_table_evict() runs a
+// CLOCK hand over the slots, next to the referenced byte readers set,
+// like swiss_table_evict().
+//
+
+#define DIRECT_TABLE_BITS      16
+#define DIRECT_TABLE_SLOTS     (1u << DIRECT_TABLE_BITS)
+#define DIRECT_STATE_EMPTY     0
+#define DIRECT_STATE_LIVE      1     /* present, never expires */
+#define DIRECT_EVICT_PER_INSERT 2
+
+enum { DIRECT_INSERTED, DIRECT_EXISTS, DIRECT_RANGE, DIRECT_UPDATED,\
+       DIRECT_MISSING, DIRECT_MISMATCH };
+
+typedef struct direct_table_t {
+	_Atomic uint64_t  slots[DIRECT_TABLE_SLOTS];
+	uint8_t           referenced[DIRECT_TABLE_SLOTS]; /* CLOCK bits */
+	size_t            max_entries;   /* cache mode, 0 off; set before use */
+	_Atomic size_t    live;          /* full slots, kept in cache mode only */
+	_Atomic size_t    hand;          /* CLOCK hand, any slot index mod slots */
+} direct_table;
+
+/* the word of a live key; an expiry of 1 is as long past as 2 */
+static inline uint64_t direct_word(uint32_t value, uint32_t expires) {
+
+	uint64_t state = !expires ? DIRECT_STATE_LIVE : (expires > 1) ? expires : 2;
+
+	return (state << 32) | value;
+}
+
+static inline uint32_t direct_word_value(uint64_t word) {
+	return (uint32_t) word;
+}
+
+/* 0 for no expiry or no key */
+static inline uint32_t direct_word_expires(uint64_t word) {
+
+	uint32_t state = (uint32_t) (word >> 32);
+
+	return (state == DIRECT_STATE_LIVE) ? 0 : state;
+}
+
+static inline bool direct_word_full(uint64_t word) {
+	return (word >> 32) != DIRECT_STATE_EMPTY;
+}
+
+static inline bool direct_word_live(uint64_t word) {
+	return direct_word_full(word) && !expiry_passed(direct_word_expires(word));
+}
+
+static inline bool direct_key_fits(uint32_t key) {
+	return key < DIRECT_TABLE_SLOTS;
+}
+
+static inline direct_table *direct_table_create(void) {
+
+	direct_table *t = (direct_table *) cache_aligned_alloc(sizeof(direct_table));
+
+	if (!t) return NULL;
+	memset(t, 0, sizeof(direct_table));
+	return t;
+}
+
+static inline void direct_table_free(direct_table *t) {
+	free(t);
+}
+
+/* a key found missing became full, or a full one missing */
+static inline void direct_count_change(direct_table *t, uint64_t old,\
+                                       uint64_t word) {
+
+	if (!t->max_entries || direct_word_full(old) == direct_word_full(word))
+		return;
+	if (direct_word_full(word)) atomic_fetch_add(&t->live, 1);
+	else atomic_fetch_sub(&t->live, 1);
+}
+
+/* lock free; false if the key is missing, expired or out of the domain */
+static inline bool direct_table_find(direct_table *t, uint32_t key,\
+                                     uint32_t *value) {
+
+	uint64_t word;
+
+	if (!direct_key_fits(key)) return false;
+	word = atomic_load_explicit(&t->slots[key], memory_order_acquire);
+	if (!direct_word_live(word)) return false;
+	*value = direct_word_value(word);
+	/* a plain store, and only once per pass of the CLOCK hand */
+	if (t->max_entries && !__atomic_load_n(&t->referenced[key], __ATOMIC_RELAXED))
+		__atomic_store_n(&t->referenced[key], 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+/* add a key that is missing or expired; the first value stored stays */
+static inline int direct_table_insert(direct_table *t, uint32_t key,\
+                                      uint32_t value, uint32_t expires) {
+
+	uint64_t old, word = direct_word(value, expires);
+
+	if (!direct_key_fits(key)) return DIRECT_RANGE;
+	old = atomic_load_explicit(&t->slots[key], memory_order_relaxed);
+	do {
+		if (direct_word_live(old)) return DIRECT_EXISTS;
+	} while (!atomic_compare_exchange_weak_explicit(&t->slots[key], &old,\
+	         word, memory_order_release, memory_order_relaxed));
+	__atomic_store_n(&t->referenced[key], 0, __ATOMIC_RELAXED);
+	direct_count_change(t, old, word);
+	return DIRECT_INSERTED;
+}
+
+/* insert or replace; *old_expires is the expiry the key had, 0 if it had
+ * none or was missing */
+static inline int direct_table_upsert(direct_table *t, uint32_t key,\
+                                      uint32_t value, uint32_t expires,\
+                                      uint32_t *old_expires) {
+
+	uint64_t old, word = direct_word(value, expires);
+
+	*old_expires = 0;
+	if (!direct_key_fits(key)) return DIRECT_RANGE;
+	old = atomic_exchange_explicit(&t->slots[key], word, memory_order_acq_rel);
+	direct_count_change(t, old, word);
+	if (!direct_word_live(old)) return DIRECT_INSERTED;
+	*old_expires = direct_word_expires(old);
+	return DIRECT_UPDATED;
+}
+
+/* replace the value only if it is expected; *value gets the one found,
+ * *expires the expiry the key keeps */
+static inline int direct_table_cas(direct_table *t, uint32_t key,\
+                                   uint32_t expected, uint32_t *value,\
+                                   uint32_t *expires) {
+
+	uint64_t old;
+
+	*expires = 0;
+	if (!direct_key_fits(key)) return DIRECT_MISSING;
+	old = atomic_load_explicit(&t->slots[key], memory_order_acquire);
+	do {
+		if (!direct_word_live(old)) return DIRECT_MISSING;
+		*expires = direct_word_expires(old);
+		if (direct_word_value(old) != expected) {
+			*value = direct_word_value(old);
+			return DIRECT_MISMATCH;
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&t->slots[key], &old,\
+	         (old & ~(uint64_t) UINT32_MAX) | *value, memory_order_acq_rel,\
+	         memory_order_acquire));
+	return DIRECT_UPDATED;
+}
+
+/* remove key, its value into *value; false if it was not there, or had
+ * expired: then it is removed all the same */
+static inline bool direct_table_delete(direct_table *t, uint32_t key,\
+                                       uint32_t *value) {
+
+	uint64_t old;
+
+	if (!direct_key_fits(key)) return false;
+	old = atomic_exchange_explicit(&t->slots[key], 0, memory_order_acq_rel);
+	direct_count_change(t, old, 0);
+	if (!direct_word_live(old)) return false;
+	*value = direct_word_value(old);
+	return true;
+}
+
+/* remove key only if it expired by now; else *expires is its expiry, 0 if
+ * it has none or is missing */
+static inline bool direct_table_expire(direct_table *t, uint32_t key,\
+                                       uint32_t now, uint32_t *expires) {
+
+	uint64_t old;
+
+	*expires = 0;
+	if (!direct_key_fits(key)) return false;
+	old = atomic_load_explicit(&t->slots[key], memory_order_relaxed);
+	do {
+		*expires = direct_word_expires(old);
+		if (!*expires || *expires > now) return false;
+	} while (!atomic_compare_exchange_weak_explicit(&t->slots[key], &old, 0,\
+	         memory_order_relaxed, memory_order_relaxed));
+	direct_count_change(t, old, 0);
+	return true;
+}
+
+/* full slots, expired or not */
+static inline size_t direct_table_count(direct_table *t) {
+
+	size_t i, count = 0;
+
+	for (i = 0; i < DIRECT_TABLE_SLOTS; i++)
+		count += direct_word_full(atomic_load_explicit(&t->slots[i],\
+		                          memory_order_relaxed));
+	return count;
+}
+
+// cache mode: evict until the table is back at max_entries
+//
+// Same CLOCK as swiss_table_evict(), without the locking: a victim goes
+// with a CAS from the very word the hand saw, so a key stored or read
+// meanwhile stays. keep is the key just inserted. Returns the number of
+// keys evicted.
+//
+static inline size_t direct_table_evict(direct_table *t, uint32_t keep) {
+
+	size_t scanned, evicted = 0, i;
+	uint64_t word;
+
+	for (scanned = 0; atomic_load(&t->live) > t->max_entries &&\
+	     evicted < DIRECT_EVICT_PER_INSERT && scanned < 2 * DIRECT_TABLE_SLOTS;\
+	     scanned++) {
+		i = atomic_fetch_add_explicit(&t->hand, 1, memory_order_relaxed) &\
+		    (DIRECT_TABLE_SLOTS - 1);
+		word = atomic_load_explicit(&t->slots[i], memory_order_relaxed);
+		if (!direct_word_full(word) || i == keep) continue;
+		if (__atomic_load_n(&t->referenced[i], __ATOMIC_RELAXED) &&\
+		    direct_word_live(word)) {
+			__atomic_store_n(&t->referenced[i], 0, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (atomic_compare_exchange_strong_explicit(&t->slots[i], &word, 0,\
+		    memory_order_relaxed, memory_order_relaxed)) {
+			direct_count_change(t, word, 0);
+			evicted++;
+		}
+	}
+	return evicted;
+}
+
+#endif /* DIRECT_TABLE_H */
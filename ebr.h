@@ -0,0 +1,199 @@
+#ifndef EBR_H
+#define EBR_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include "lock_stripe.h"
+#include "thread_registry.h"
+
+//
+// Epoch-based memory reclamation (EBR).
+//
+// Lock-free readers wrap every access to shared nodes in ebr_enter() /
+// ebr_exit(). Whoever unlinks something hands it to ebr_retire() instead
+// of freeing it. The global epoch only moves on once every thread inside
+// a read section has observed the current value, so an object retired
+// in epoch e is unreachable by the time the epoch reaches e + 2 and its
+// free function runs.
+//
+// Every thread owns one record, taken on its first ebr_enter() and given
+// back when the thread exits. Objects it retired but could not free yet
+// stay on the record and are freed by its next owner, or by ebr_drain().
+//
+// The limbo is a ring of entries owned by the record, oldest first: they
+// are retired in epoch order, so freeing stops at the first one that is
+// too young, and a retire allocates nothing unless a reader has held the
+// epoch long enough for the ring to fill, when it doubles.
+//
+
+#define EBR_RECLAIM_INTERVAL   64   /* read sections between reclaim attempts */
+#define EBR_RETIRE_INTERVAL    32   /* retires between epoch advance attempts */
+#define EBR_LIMBO_INITIAL      256  /* entries of a record's first ring */
+
+typedef struct ebr_retired_t {
+	unsigned long          epoch;       /* global epoch when retired */
+	void                 (*free_fn)(void *ctx, void *ptr);
+	void                  *ctx;
+	void                  *ptr;
+} ebr_retired;
+
+typedef struct ebr_record_t {
+	thread_slot            slot;        /* must stay first */
+	_Atomic unsigned long  state;       /* epoch << 1 | 1 while in a section */
+	ebr_retired           *limbo;       /* owner only, a ring */
+	size_t                 limbo_size;  /* entries, a power of two */
+	size_t                 limbo_head;  /* oldest entry */
+	size_t                 limbo_count;
+	unsigned int           nesting;
+	unsigned int           exits;
+	unsigned int           retires;
+} __attribute__((aligned(CACHE_LINE_SIZE))) ebr_record;
+
+/* thread exit: the record and whatever it still holds go to the next owner */
+static void ebr_release_record(void *arg) {
+
+	ebr_record *rec = (ebr_record *) arg;
+
+	atomic_store_explicit(&rec->state, 0, memory_order_release);
+	thread_slot_release(&rec->slot);
+}
+
+static _Atomic unsigned long     ebr_epoch = 0;
+static thread_registry           ebr_records =\
+                                 THREAD_REGISTRY_INIT(ebr_release_record);
+static __thread ebr_record      *ebr_self;
+
+/* slow path of ebr_enter(): reuse a record of an exited thread or add one */
+static inline ebr_record *ebr_claim_record(void) {
+
+	ebr_record *rec = (ebr_record *) thread_registry_claim(&ebr_records);
+
+	if (!rec) {
+		rec = (ebr_record *) cache_aligned_alloc(sizeof(ebr_record));
+		if (!rec) {perror("ERROR allocating EBR record"); exit(1);}
+		atomic_init(&rec->state, 0);
+		rec->limbo       = NULL;
+		rec->limbo_size  = 0;
+		rec->limbo_head  = 0;
+		rec->limbo_count = 0;
+		thread_registry_add(&ebr_records, &rec->slot);
+	}
+	rec->nesting = 0;
+	rec->exits   = 0;
+	rec->retires = 0;
+	ebr_self = rec;
+	return rec;
+}
+
+/* free what this thread retired at least two epochs ago, oldest first */
+static inline void ebr_free_limbo(ebr_record *rec, unsigned long epoch) {
+
+	ebr_retired r;
+
+	while (rec->limbo_count &&\
+	       epoch - rec->limbo[rec->limbo_head].epoch >= 2) {
+		r = rec->limbo[rec->limbo_head];
+		rec->limbo_head = (rec->limbo_head + 1) & (rec->limbo_size - 1);
+		rec->limbo_count--;
+		r.free_fn(r.ctx, r.ptr);
+	}
+}
+
+/* a full ring doubles, its entries moved to the front in order */
+static inline void ebr_grow_limbo(ebr_record *rec) {
+
+	size_t size = rec->limbo_size ? 2 * rec->limbo_size : EBR_LIMBO_INITIAL;
+	ebr_retired *limbo = (ebr_retired *) malloc(size * sizeof(ebr_retired));
+	size_t i;
+
+	if (!limbo) {perror("ERROR allocating EBR limbo"); exit(1);}
+	for (i = 0; i < rec->limbo_count; i++)
+		limbo[i] = rec->limbo[(rec->limbo_head + i) & (rec->limbo_size - 1)];
+	free(rec->limbo);
+	rec->limbo      = limbo;
+	rec->limbo_size = size;
+	rec->limbo_head = 0;
+}
+
+// epoch advance
+//
+// Moves the global epoch on by one if no thread is still in a read
+// section that started in an earlier epoch, then frees the calling
+// thread's objects that have become unreachable.
+//
+static inline void ebr_reclaim(void) {
+
+	unsigned long epoch = atomic_load(&ebr_epoch), state;
+	ebr_record *rec;
+
+	for (rec = (ebr_record *) thread_registry_first(&ebr_records); rec;\
+	     rec = (ebr_record *) rec->slot.next) {
+		state = atomic_load(&rec->state);
+		if ((state & 1) && (state >> 1) != epoch) break;
+	}
+	if (!rec && atomic_compare_exchange_strong(&ebr_epoch, &epoch, epoch + 1))
+		epoch++;
+	ebr_free_limbo(ebr_self, epoch);
+}
+
+/* start of a read section; nodes seen inside it stay valid until ebr_exit() */
+static inline void ebr_enter(void) {
+
+	ebr_record *rec = ebr_self ? ebr_self : ebr_claim_record();
+
+	if (rec->nesting++) return;
+	/* a seq_cst exchange: the announcement is visible before any shared
+	 * pointer is read */
+	atomic_exchange_explicit(&rec->state,\
+	    atomic_load_explicit(&ebr_epoch, memory_order_relaxed) << 1 | 1,\
+	    memory_order_seq_cst);
+}
+
+static inline void ebr_exit(void) {
+
+	ebr_record *rec = ebr_self;
+
+	if (--rec->nesting) return;
+	atomic_store_explicit(&rec->state, 0, memory_order_release);
+	if (rec->limbo_count && ++rec->exits % EBR_RECLAIM_INTERVAL == 0)
+		ebr_reclaim();
+}
+
+/* free_fn(ctx, ptr) runs once no read section can still see ptr */
+static inline void ebr_retire(void (*free_fn)(void *ctx, void *ptr),\
+                              void *ctx, void *ptr) {
+
+	ebr_record *rec = ebr_self ? ebr_self : ebr_claim_record();
+	ebr_retired *r;
+
+	/* a full ring first tries to free some, and only grows if it can't */
+	if (rec->limbo_count == rec->limbo_size) {
+		if (rec->limbo_size) ebr_reclaim();
+		if (rec->limbo_count == rec->limbo_size) ebr_grow_limbo(rec);
+	}
+	r = &rec->limbo[(rec->limbo_head + rec->limbo_count) &\
+	                (rec->limbo_size - 1)];
+	r->epoch   = atomic_load(&ebr_epoch);
+	r->free_fn = free_fn;
+	r->ctx     = ctx;
+	r->ptr     = ptr;
+	rec->limbo_count++;
+	/* scanning every record is only worth it every so often */
+	if (++rec->retires % EBR_RETIRE_INTERVAL == 0)
+		ebr_reclaim();
+	else
+		ebr_free_limbo(rec, atomic_load(&ebr_epoch));
+}
+
+/* teardown only, with no thread left in a read section: free everything */
+static inline void ebr_drain(void) {
+
+	ebr_record *rec;
+
+	for (rec = (ebr_record *) thread_registry_first(&ebr_records); rec;\
+	     rec = (ebr_record *) rec->slot.next)
+		ebr_free_limbo(rec, atomic_load(&ebr_epoch) + 2);
+}
+
+#endif /* EBR_H */
@@ -0,0 +1,75 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+//
+// Key hashing for the table engines, in the style of wyhash.
+//
+// A 32-bit key is spread over both halves of a 64-bit word, xored with
+// secrets and the seed and folded through a 64x64->128 bit multiply
+// twice: every output bit depends on every key and seed bit, for about
+// two multiplies. The seed is random per process (hash_seed_init()), so
+// nobody outside can precompute keys that all land in one bucket.
+//
+// Reduction to a table index never divides: hash_range() maps the high
+// 32 bits onto [0, n) with one multiply (fastrange), hash_mask() takes
+// the low bits for power-of-two tables.
+//
+
+#define HASH_SECRET0           0xa0761d6478bd642full
+#define HASH_SECRET1           0xe7037ed1a0b428dbull
+#define HASH_SECRET2           0x8ebc6af09c88c6e3ull
+
+/* left at a fixed value until hash_seed_init(): benchmarks stay repeatable */
+static uint64_t hash_seed = HASH_SECRET2;
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+
+	__uint128_t r = (__uint128_t) a * b;
+
+	return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+static inline uint64_t hash_key_seeded(uint32_t key, uint64_t seed) {
+
+	uint64_t a = (((uint64_t) key << 32) | key) ^ HASH_SECRET1;
+	__uint128_t r = (__uint128_t) a * (seed ^ HASH_SECRET0);
+
+	return hash_mix((uint64_t) r ^ HASH_SECRET1 ^ 4,\
+	                (uint64_t) (r >> 64) ^ seed);
+}
+
+static inline uint64_t hash_key(uint32_t key) {
+	return hash_key_seeded(key, hash_seed);
+}
+
+/* a 64-bit key, of the blob table: the high half goes into both multiplies */
+static inline uint64_t hash_key64(uint64_t key) {
+	return hash_mix(hash_mix(key ^ HASH_SECRET1, hash_seed ^ HASH_SECRET0) ^\
+	                HASH_SECRET1 ^ 8, (key >> 32) ^ hash_seed);
+}
+
+/* index in [0, n) from the high half of a hash */
+static inline uint32_t hash_range(uint64_t h, uint32_t n) {
+	return (uint32_t) (((h >> 32) * n) >> 32);
+}
+
+static inline uint64_t hash_mask(uint64_t h, uint64_t mask) {
+	return h & mask;
+}
+
+/* call once at startup, before any table exists */
+static inline void hash_seed_init(void) {
+
+	uint64_t seed;
+
+	if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed))
+		seed = (uint64_t) time(NULL) * HASH_SECRET0 ^ (uint64_t) getpid();
+	hash_seed = hash_mix(seed ^ HASH_SECRET0, HASH_SECRET1);
+}
+
+#endif /* HASH_H */
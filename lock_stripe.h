@@ -0,0 +1,89 @@
+#ifndef LOCK_STRIPE_H
+#define LOCK_STRIPE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <stdlib.h>
+
+#define CACHE_LINE_SIZE        64
+
+/* aligned_alloc() wants the size to be a multiple of the alignment */
+static inline void *cache_aligned_alloc(size_t size) {
+
+	return aligned_alloc(CACHE_LINE_SIZE,\
+	                     (size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1));
+}
+
+// lock stripe
+//
+// Writers serialize on the spinlock. Readers never touch the stripe: they
+// walk chains lock free inside an EBR section (ebr.h), so read-mostly
+// traffic keeps the line shared.
+//
+typedef struct lock_stripe_t {
+	_Atomic unsigned int lock;
+	unsigned int         count;  /* entries guarded, only touched under lock */
+	unsigned int         hand;   /* owner's cursor, e.g. a CLOCK hand; likewise */
+} __attribute__((aligned(CACHE_LINE_SIZE))) lock_stripe;
+
+/* contention tally of the calling thread, set up by whoever collects it */
+typedef struct stripe_wait_stats_t {
+	_Atomic uint64_t     contended;  /* acquisitions that had to spin */
+	_Atomic uint64_t     wait_ns;    /* time spent spinning for them */
+} stripe_wait_stats;
+
+static __thread stripe_wait_stats *stripe_wait_tally;
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static inline void stripe_init(lock_stripe *stripe) {
+
+	atomic_init(&stripe->lock, 0);
+	stripe->count = 0;
+	stripe->hand  = 0;
+}
+
+/* owner-only counter bump: a plain load and store, no locked instruction */
+static inline void stripe_tally_add(_Atomic uint64_t *counter, uint64_t n) {
+
+	atomic_store_explicit(counter, n +\
+	        atomic_load_explicit(counter, memory_order_relaxed),\
+	        memory_order_relaxed);
+}
+
+/* writer side: test-and-test-and-set spinlock */
+static inline void stripe_write_lock(lock_stripe *stripe) {
+
+	struct timespec start, end;
+
+	if (atomic_exchange_explicit(&stripe->lock, 1, memory_order_acquire)) {
+		/* only a contended acquisition pays for reading the clock */
+		if (stripe_wait_tally) clock_gettime(CLOCK_MONOTONIC, &start);
+		do {
+			while (atomic_load_explicit(&stripe->lock, memory_order_relaxed))
+				cpu_relax();
+		} while (atomic_exchange_explicit(&stripe->lock, 1,\
+		                                  memory_order_acquire));
+		if (stripe_wait_tally) {
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			stripe_tally_add(&stripe_wait_tally->contended, 1);
+			stripe_tally_add(&stripe_wait_tally->wait_ns,\
+			        (end.tv_sec - start.tv_sec) * 1000000000ULL +\
+			        end.tv_nsec - start.tv_nsec);
+		}
+	}
+}
+
+static inline void stripe_write_unlock(lock_stripe *stripe) {
+
+	atomic_store_explicit(&stripe->lock, 0, memory_order_release);
+}
+
+#endif /* LOCK_STRIPE_H */
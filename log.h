@@ -0,0 +1,277 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "lock_stripe.h"
+#include "thread_registry.h"
+
+//
+// Asynchronous, level-gated logging.
+//
+// LOG(level, fmt, args...) costs one compare when the level is off at run
+// time and nothing at all when it is above LOG_COMPILE_LEVEL: the site is
+// dead code and the compiler drops it, arguments included. An enabled
+// site copies a timestamp, the format pointer and up to LOG_MAX_ARGS
+// arguments into the calling thread's ring, a single-producer single-
+// consumer queue, and returns: no formatting, no stdio lock, no system
+// call. A background thread merges the rings by timestamp, formats the
+// records and writes them out.
+//
+// Formats must be string literals, they are only read when the record is
+// formatted; conversions are d i u o x X c s p, without '*' widths.
+// Arguments are integers, or string literals wrapped in LOG_STR(). A full
+// ring drops the record and counts it, the request path never waits.
+//
+
+#define LOG_LEVEL_ERROR        0
+#define LOG_LEVEL_WARN         1
+#define LOG_LEVEL_INFO         2
+#define LOG_LEVEL_DEBUG        3    /* one or more lines per request */
+#define LOG_LEVEL_TRACE        4
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL      LOG_LEVEL_INFO
+#endif
+
+#define LOG_MAX_ARGS           6
+#define LOG_RING_SIZE          1024 /* records per thread, power of two */
+#define LOG_IDLE_SLEEP_NS      1000000
+
+typedef unsigned long long log_arg_t;
+
+#define LOG_STR(s)             ((log_arg_t) (uintptr_t) (const char *) (s))
+
+#define LOG(level, fmt, ...) do {                                            \
+	if ((level) <= LOG_COMPILE_LEVEL && (level) <= log_level) {          \
+		log_arg_t log_args_[] = { 0, ##__VA_ARGS__ };                \
+		_Static_assert(sizeof(log_args_) / sizeof(log_arg_t) - 1 <=  \
+		               LOG_MAX_ARGS, "too many log arguments");      \
+		log_write((level), (fmt), log_args_ + 1,                     \
+		          sizeof(log_args_) / sizeof(log_arg_t) - 1);        \
+	}                                                                    \
+} while (0)
+
+typedef struct log_record_t {
+	uint64_t      ts;                   /* CLOCK_REALTIME, nanoseconds */
+	const char   *fmt;
+	uint32_t      level;
+	uint32_t      nargs;
+	log_arg_t     args[LOG_MAX_ARGS];
+} log_record;
+
+typedef struct log_ring_t {
+	thread_slot         slot;           /* must stay first */
+	_Atomic uint64_t    head __attribute__((aligned(CACHE_LINE_SIZE)));
+	_Atomic uint64_t    tail __attribute__((aligned(CACHE_LINE_SIZE)));
+	_Atomic uint64_t    dropped;        /* records lost to a full ring */
+	uint64_t            dropped_seen;   /* logger only */
+	log_record          slots[LOG_RING_SIZE];
+} log_ring;
+
+static int                   log_level = LOG_LEVEL_INFO;
+static FILE                 *log_out;
+/* thread exit hands the ring to the next thread, its records stay queued */
+static thread_registry       log_rings =\
+                             THREAD_REGISTRY_INIT(thread_slot_release);
+static pthread_mutex_t       log_consumer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t             log_thread;
+static _Atomic int           log_running = 0;
+static __thread log_ring    *log_self;
+
+static const char *log_level_names[] = { "ERROR", "WARN", "INFO", "DEBUG",\
+                                         "TRACE" };
+
+/* slow path of log_write(): reuse the ring of an exited thread or add one */
+static inline log_ring *log_claim_ring(void) {
+
+	log_ring *ring = (log_ring *) thread_registry_claim(&log_rings);
+
+	if (!ring) {
+		ring = (log_ring *) cache_aligned_alloc(sizeof(log_ring));
+		if (!ring) return NULL;
+		atomic_init(&ring->head, 0);
+		atomic_init(&ring->tail, 0);
+		atomic_init(&ring->dropped, 0);
+		ring->dropped_seen = 0;
+		thread_registry_add(&log_rings, &ring->slot);
+	}
+	log_self = ring;
+	return ring;
+}
+
+/* producer side, called through LOG() only */
+static inline void log_write(int level, const char *fmt, const log_arg_t *args,\
+                             unsigned int nargs) {
+
+	log_ring *ring = log_self ? log_self : log_claim_ring();
+	log_record *rec;
+	struct timespec now;
+	uint64_t head;
+
+	if (!ring) return;
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >=\
+	    LOG_RING_SIZE) {
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return;
+	}
+	clock_gettime(CLOCK_REALTIME, &now);
+	rec        = &ring->slots[head & (LOG_RING_SIZE - 1)];
+	rec->ts    = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+	rec->fmt   = fmt;
+	rec->level = level;
+	rec->nargs = nargs;
+	memcpy(rec->args, args, nargs * sizeof(log_arg_t));
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// record formatter
+//
+// Walks the format one conversion at a time and hands each its argument
+// with the width the record stored it at, so "%x" of an unsigned int is
+// printed as "%llx" of the widened value.
+//
+static inline void log_format(FILE *out, const log_record *rec) {
+
+	const char *p = rec->fmt, *start;
+	char spec[32];
+	size_t n;
+	unsigned int a = 0;
+	log_arg_t arg;
+	time_t sec = rec->ts / 1000000000;
+	struct tm tm;
+
+	localtime_r(&sec, &tm);
+	fprintf(out, "%02d:%02d:%02d.%06llu %-5s ", tm.tm_hour, tm.tm_min,\
+	        tm.tm_sec, (unsigned long long) (rec->ts % 1000000000) / 1000,\
+	        log_level_names[rec->level]);
+
+	while (*p) {
+		if (*p != '%' || p[1] == '%') {
+			fputc(*p, out);
+			p += (*p == '%') ? 2 : 1;
+			continue;
+		}
+		start = p++;
+		p += strspn(p, "-+ #0123456789.");
+		n  = p - start;
+		p += strspn(p, "hljztL");   /* replaced by the stored width */
+		if (!*p || n + 4 > sizeof(spec)) break;
+		memcpy(spec, start, n);
+		arg = (a < rec->nargs) ? rec->args[a++] : 0;
+
+		switch (*p) {
+		case 'd': case 'i':
+			memcpy(spec + n, "ll", 2);
+			spec[n + 2] = *p; spec[n + 3] = '\0';
+			fprintf(out, spec, (long long) arg);
+			break;
+		case 'u': case 'o': case 'x': case 'X':
+			memcpy(spec + n, "ll", 2);
+			spec[n + 2] = *p; spec[n + 3] = '\0';
+			fprintf(out, spec, arg);
+			break;
+		case 'c':
+			spec[n] = *p; spec[n + 1] = '\0';
+			fprintf(out, spec, (int) arg);
+			break;
+		case 's':
+			spec[n] = *p; spec[n + 1] = '\0';
+			fprintf(out, spec, arg ? (const char *) (uintptr_t) arg : "(null)");
+			break;
+		case 'p':
+			spec[n] = *p; spec[n + 1] = '\0';
+			fprintf(out, spec, (void *) (uintptr_t) arg);
+			break;
+		default:
+			fwrite(start, 1, p + 1 - start, out);
+			break;
+		}
+		p++;
+	}
+	fputc('\n', out);
+}
+
+/* format everything queued, oldest first across rings; returns the count */
+static inline unsigned int log_drain(void) {
+
+	log_ring *ring, *oldest;
+	log_record *rec, *oldest_rec = NULL;
+	uint64_t tail, dropped;
+	unsigned int count = 0;
+
+	pthread_mutex_lock(&log_consumer_lock);
+	while (1) {
+		oldest = NULL;
+		for (ring = (log_ring *) thread_registry_first(&log_rings); ring;\
+		     ring = (log_ring *) ring->slot.next) {
+			tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+			if (tail == atomic_load_explicit(&ring->head, memory_order_acquire))
+				continue;
+			rec = &ring->slots[tail & (LOG_RING_SIZE - 1)];
+			if (!oldest || rec->ts < oldest_rec->ts) {
+				oldest     = ring;
+				oldest_rec = rec;
+			}
+		}
+		if (!oldest) break;
+		log_format(log_out, oldest_rec);
+		atomic_fetch_add_explicit(&oldest->tail, 1, memory_order_release);
+		count++;
+	}
+	for (ring = (log_ring *) thread_registry_first(&log_rings); ring;\
+	     ring = (log_ring *) ring->slot.next) {
+		dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+		if (dropped != ring->dropped_seen) {
+			fprintf(log_out, "log: %llu records dropped, ring full\n",\
+			        (unsigned long long) (dropped - ring->dropped_seen));
+			ring->dropped_seen = dropped;
+		}
+	}
+	if (count) fflush(log_out);
+	pthread_mutex_unlock(&log_consumer_lock);
+	return count;
+}
+
+/* background logger: drains the rings, naps when there was nothing */
+static void *log_main(void *arg) {
+
+	struct timespec nap = { 0, LOG_IDLE_SLEEP_NS };
+
+	(void) arg;
+	while (atomic_load(&log_running)) {
+		if (!log_drain()) nanosleep(&nap, NULL);
+	}
+	return NULL;
+}
+
+/* start the background logger; records go to out at level and below */
+static inline void log_init(int level, FILE *out) {
+
+	log_level = level;
+	log_out   = out;
+	atomic_store(&log_running, 1);
+	if (pthread_create(&log_thread, NULL, log_main, NULL)) {
+		perror("ERROR creating log thread");
+		exit(1);
+	}
+}
+
+/* write out everything logged so far, e.g. before exiting on an error */
+static inline void log_flush(void) {
+	log_drain();
+}
+
+static inline void log_shutdown(void) {
+
+	atomic_store(&log_running, 0);
+	pthread_join(log_thread, NULL);
+	log_drain();
+}
+
+#endif /* LOG_H */
@@ -0,0 +1,318 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "lock_stripe.h"
+#include "thread_registry.h"
+
+//
+// Server metrics: counters and latency histograms.
+//
+// Every thread that records anything owns a metrics_block and is its only
+// writer, so a bump is a relaxed load and store on a line nobody else
+// writes: no locked instruction, no cache line bouncing. Readers (STATS,
+// the dump thread) sum all blocks with relaxed loads; a snapshot is not
+// atomic across counters, which is fine for monitoring.
+//
+// Histograms are HDR style: values below 2^METRICS_SUB_BITS nanoseconds
+// get a bucket each, above that every power of two is split into
+// 2^(METRICS_SUB_BITS - 1) buckets, so any value is off by at most about
+// 3% whatever its magnitude.
+//
+
+enum {
+	MET_OPS_STOR,
+	MET_OPS_RETR,
+	MET_OPS_MSTOR,
+	MET_OPS_MRETR,
+	MET_OPS_HELLO,
+	MET_OPS_STATS,
+	MET_OPS_DEL,
+	MET_OPS_UPSERT,
+	MET_OPS_CAS,
+	MET_OPS_BSET,             /* v3, 64-bit keyspace */
+	MET_OPS_BGET,
+	MET_OPS_BDEL,
+	MET_KEYS_STORED,          /* keys of STOR, MSTOR and BSET */
+	MET_HITS,                 /* keys of RETR, MRETR and BGET found */
+	MET_MISSES,
+	MET_KEYS_UPDATED,         /* UPSERTs, and CASes that matched */
+	MET_KEYS_DELETED,         /* DELs and BDELs that found their key */
+	MET_KEYS_EXPIRED,         /* keys the expiry reaper deleted */
+	MET_KEYS_EVICTED,         /* keys cache mode (-C) evicted for room */
+	MET_BYTES_IN,
+	MET_BYTES_OUT,
+	MET_CONN_ACCEPTED,
+	MET_CONN_CLOSED,
+	MET_DGRAMS_IN,            /* -u: requests received as datagrams */
+	MET_DGRAMS_OUT,
+	MET_DGRAMS_DROPPED,       /* malformed, or the reply could not go */
+	MET_WAL_RECORDS,          /* changes made durable by the WAL */
+	MET_WAL_SYNCS,            /* batches, one fdatasync each */
+	MET_NUM_COUNTERS
+};
+
+enum {
+	MET_HIST_DECODE,          /* one request, from rbuf to work item */
+	MET_HIST_TABLE_OP,        /* one command or batch, on its worker */
+	MET_HIST_ENCODE,          /* one response, into wbuf */
+	MET_HIST_WAL_SYNC,        /* one WAL batch, write and fdatasync */
+	MET_NUM_HISTS
+};
+
+#define METRICS_SUB_BITS       5
+#define METRICS_MAX_BITS       40   /* values are clamped below 2^40 ns */
+#define METRICS_HIST_BUCKETS   ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) *\
+                                (1 << (METRICS_SUB_BITS - 1)) +\
+                                (1 << METRICS_SUB_BITS))
+#define METRICS_TEXT_LEN       2048 /* room for metrics_format() */
+
+static const char *metrics_counter_names[MET_NUM_COUNTERS] = {
+	"ops_stor", "ops_retr", "ops_mstor", "ops_mretr", "ops_hello",
+	"ops_stats", "ops_del", "ops_upsert", "ops_cas", "ops_bset", "ops_bget",
+	"ops_bdel", "keys_stored", "hits", "misses", "keys_updated",
+	"keys_deleted", "keys_expired", "keys_evicted", "bytes_in", "bytes_out",
+	"conn_accepted", "conn_closed", "dgrams_in", "dgrams_out",
+	"dgrams_dropped", "wal_records", "wal_syncs",
+};
+
+static const char *metrics_hist_names[MET_NUM_HISTS] = {
+	"decode_ns", "table_op_ns", "encode_ns", "wal_sync_ns",
+};
+
+typedef struct metrics_block_t {
+	thread_slot              slot;       /* must stay first */
+	_Atomic uint64_t         counters[MET_NUM_COUNTERS];
+	stripe_wait_stats        lock_wait;  /* fed by stripe_write_lock() */
+	_Atomic uint64_t         hist[MET_NUM_HISTS][METRICS_HIST_BUCKETS];
+	_Atomic uint64_t         hist_max[MET_NUM_HISTS];
+} __attribute__((aligned(CACHE_LINE_SIZE))) metrics_block;
+
+/* sum of all blocks at one point in time */
+typedef struct metrics_snapshot_t {
+	uint64_t  counters[MET_NUM_COUNTERS];
+	uint64_t  lock_contended;
+	uint64_t  lock_wait_ns;
+	uint64_t  hist[MET_NUM_HISTS][METRICS_HIST_BUCKETS];
+	uint64_t  hist_max[MET_NUM_HISTS];
+} metrics_snapshot;
+
+/* thread exit hands the block, with its counts, to the next thread */
+static thread_registry           metrics_blocks =\
+                                 THREAD_REGISTRY_INIT(thread_slot_release);
+static __thread metrics_block   *metrics_self;
+static struct timespec           metrics_start;
+
+/* slow path of the first bump of a thread */
+static inline metrics_block *metrics_claim_block(void) {
+
+	metrics_block *block =\
+	        (metrics_block *) thread_registry_claim(&metrics_blocks);
+
+	if (!block) {
+		block = (metrics_block *) cache_aligned_alloc(sizeof(metrics_block));
+		if (!block) {perror("ERROR allocating metrics"); exit(1);}
+		memset(block, 0, sizeof(metrics_block));
+		thread_registry_add(&metrics_blocks, &block->slot);
+	}
+	stripe_wait_tally = &block->lock_wait;
+	metrics_self      = block;
+	return block;
+}
+
+/* call once at startup, before any thread records anything */
+static inline void metrics_init(void) {
+
+	clock_gettime(CLOCK_MONOTONIC, &metrics_start);
+	metrics_claim_block();
+}
+
+static inline uint64_t metrics_now(void) {
+
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static inline void metrics_add(unsigned int counter, uint64_t n) {
+
+	metrics_block *block = metrics_self ? metrics_self : metrics_claim_block();
+
+	stripe_tally_add(&block->counters[counter], n);
+}
+
+static inline unsigned int metrics_bucket(uint64_t value) {
+
+	unsigned int msb, shift;
+
+	if (value < (1 << METRICS_SUB_BITS)) return value;
+	if (value >> METRICS_MAX_BITS) value = (1ULL << METRICS_MAX_BITS) - 1;
+	msb   = 63 - __builtin_clzll(value);
+	shift = msb - METRICS_SUB_BITS + 1;
+	return shift * (1 << (METRICS_SUB_BITS - 1)) + (value >> shift);
+}
+
+/* smallest value that lands in a bucket */
+static inline uint64_t metrics_bucket_floor(unsigned int bucket) {
+
+	unsigned int half = 1 << (METRICS_SUB_BITS - 1), shift;
+
+	if (bucket < 2 * half) return bucket;
+	shift = bucket / half - 1;
+	return (uint64_t) (bucket % half + half) << shift;
+}
+
+/* record one latency, in nanoseconds since start */
+static inline void metrics_record(unsigned int hist, uint64_t start) {
+
+	metrics_block *block = metrics_self ? metrics_self : metrics_claim_block();
+	uint64_t value = metrics_now() - start;
+
+	stripe_tally_add(&block->hist[hist][metrics_bucket(value)], 1);
+	if (value > atomic_load_explicit(&block->hist_max[hist], memory_order_relaxed))
+		atomic_store_explicit(&block->hist_max[hist], value,\
+		                      memory_order_relaxed);
+}
+
+static inline void metrics_collect(metrics_snapshot *snap) {
+
+	metrics_block *block;
+	unsigned int i, b;
+	uint64_t max;
+
+	memset(snap, 0, sizeof(*snap));
+	for (block = (metrics_block *) thread_registry_first(&metrics_blocks);\
+	     block; block = (metrics_block *) block->slot.next) {
+		for (i = 0; i < MET_NUM_COUNTERS; i++)
+			snap->counters[i] += atomic_load_explicit(&block->counters[i],\
+			                                          memory_order_relaxed);
+		snap->lock_contended += atomic_load_explicit(\
+		        &block->lock_wait.contended, memory_order_relaxed);
+		snap->lock_wait_ns   += atomic_load_explicit(\
+		        &block->lock_wait.wait_ns, memory_order_relaxed);
+		for (i = 0; i < MET_NUM_HISTS; i++) {
+			for (b = 0; b < METRICS_HIST_BUCKETS; b++)
+				snap->hist[i][b] += atomic_load_explicit(&block->hist[i][b],\
+				                                         memory_order_relaxed);
+			max = atomic_load_explicit(&block->hist_max[i], memory_order_relaxed);
+			if (max > snap->hist_max[i]) snap->hist_max[i] = max;
+		}
+	}
+}
+
+/* value below which a fraction per_mille / 1000 of the samples fall */
+static inline uint64_t metrics_percentile(const uint64_t *hist, uint64_t count,\
+                                          unsigned int per_mille) {
+
+	uint64_t rank = (count * per_mille + 999) / 1000, seen = 0;
+	unsigned int b;
+
+	for (b = 0; b < METRICS_HIST_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen >= rank && seen) return metrics_bucket_floor(b);
+	}
+	return 0;
+}
+
+// metrics text
+//
+// One "name value" pair per line, the format of both STATS and the dump
+// file. Returns the length written, at most len - 1.
+//
+static inline size_t metrics_format(char *buf, size_t len) {
+
+	metrics_snapshot *snap = (metrics_snapshot *) malloc(sizeof(metrics_snapshot));
+	struct timespec now;
+	uint64_t count;
+	size_t off = 0;
+	unsigned int i, b;
+
+#define METRICS_PRINT(...) do {                                              \
+	int n_ = snprintf(buf + off, len - off, __VA_ARGS__);                \
+	if (n_ > 0) off = (off + n_ < len) ? off + n_ : len - 1;             \
+} while (0)
+
+	if (!snap || !len) {free(snap); return 0;}
+	buf[0] = '\0';
+	metrics_collect(snap);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	METRICS_PRINT("uptime_s %lld\n", (long long) (now.tv_sec - metrics_start.tv_sec));
+	for (i = 0; i < MET_NUM_COUNTERS; i++)
+		METRICS_PRINT("%s %llu\n", metrics_counter_names[i],\
+		              (unsigned long long) snap->counters[i]);
+	METRICS_PRINT("conn_open %llu\n", (unsigned long long)\
+	              (snap->counters[MET_CONN_ACCEPTED] - snap->counters[MET_CONN_CLOSED]));
+	count = snap->counters[MET_HITS] + snap->counters[MET_MISSES];
+	METRICS_PRINT("hit_ratio_pct %.2f\n", count ? 100.0 *\
+	              snap->counters[MET_HITS] / count : 0.0);
+	METRICS_PRINT("lock_contended %llu\nlock_wait_ns %llu\n",\
+	              (unsigned long long) snap->lock_contended,\
+	              (unsigned long long) snap->lock_wait_ns);
+	for (i = 0; i < MET_NUM_HISTS; i++) {
+		for (b = 0, count = 0; b < METRICS_HIST_BUCKETS; b++)
+			count += snap->hist[i][b];
+		METRICS_PRINT("%s_count %llu\n", metrics_hist_names[i],\
+		              (unsigned long long) count);
+		METRICS_PRINT("%s_p50 %llu\n%s_p90 %llu\n%s_p99 %llu\n"\
+		              "%s_p999 %llu\n%s_max %llu\n",\
+		    metrics_hist_names[i], (unsigned long long)\
+		    metrics_percentile(snap->hist[i], count, 500),\
+		    metrics_hist_names[i], (unsigned long long)\
+		    metrics_percentile(snap->hist[i], count, 900),\
+		    metrics_hist_names[i], (unsigned long long)\
+		    metrics_percentile(snap->hist[i], count, 990),\
+		    metrics_hist_names[i], (unsigned long long)\
+		    metrics_percentile(snap->hist[i], count, 999),\
+		    metrics_hist_names[i], (unsigned long long) snap->hist_max[i]);
+	}
+#undef METRICS_PRINT
+	free(snap);
+	return off;
+}
+
+/* dump thread: rewrites the file every interval, renamed into place */
+typedef struct metrics_dump_t {
+	const char    *path;
+	unsigned int   interval_s;
+} metrics_dump;
+
+static void *metrics_dump_main(void *arg) {
+
+	metrics_dump *dump = (metrics_dump *) arg;
+	char text[METRICS_TEXT_LEN], tmp[4096];
+	size_t len;
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", dump->path);
+	while (1) {
+		sleep(dump->interval_s);
+		len = metrics_format(text, sizeof(text));
+		if ((f = fopen(tmp, "w")) == NULL) {
+			perror("ERROR opening metrics dump file");
+			continue;
+		}
+		fwrite(text, 1, len, f);
+		if (fclose(f) == 0) rename(tmp, dump->path);
+	}
+	return NULL;
+}
+
+static inline void metrics_start_dump(metrics_dump *dump) {
+
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, metrics_dump_main, dump)) {
+		perror("ERROR creating metrics dump thread");
+		exit(1);
+	}
+	pthread_detach(thread);
+}
+
+#endif /* METRICS_H */
@@ -0,0 +1,82 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+//
+// Intrusive multi-producer single-consumer queue (Vyukov).
+//
+// Producers never block or retry: a push is one atomic exchange plus one
+// store. The single consumer may see the queue as transiently empty while
+// a producer sits between those two steps; callers that sleep must therefore
+// use mpsc_queue_is_empty() after announcing themselves as sleeping, and
+// producers must wake the consumer only after mpsc_queue_push() returns.
+//
+
+/* embed as the first member of any struct that travels through a queue */
+typedef struct mpsc_node_t {
+	struct mpsc_node_t * _Atomic next;
+} mpsc_node;
+
+typedef struct mpsc_queue_t {
+	mpsc_node * _Atomic head;              /* producers push here */
+	char                pad[64 - sizeof(void *)];
+	mpsc_node          *tail;              /* consumer pops here */
+	mpsc_node           stub;
+} mpsc_queue;
+
+static inline void mpsc_queue_init(mpsc_queue *q) {
+
+	atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+	atomic_store_explicit(&q->head, &q->stub, memory_order_relaxed);
+	q->tail = &q->stub;
+}
+
+/* safe to call from any number of threads */
+static inline void mpsc_queue_push(mpsc_queue *q, mpsc_node *node) {
+
+	mpsc_node *prev;
+
+	atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+	prev = atomic_exchange_explicit(&q->head, node, memory_order_seq_cst);
+	atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+/* consumer only: returns NULL when empty or when a push is half way done */
+static inline mpsc_node *mpsc_queue_pop(mpsc_queue *q) {
+
+	mpsc_node *tail = q->tail;
+	mpsc_node *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+	if (tail == &q->stub) {
+		if (next == NULL) return NULL;
+		q->tail = next;
+		tail    = next;
+		next    = atomic_load_explicit(&next->next, memory_order_acquire);
+	}
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+		return NULL;
+
+	/* tail is the last node: park the stub behind it so it can be handed out */
+	mpsc_queue_push(q, &q->stub);
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+/* consumer only: a push that has not finished linking counts as non-empty */
+static inline int mpsc_queue_is_empty(mpsc_queue *q) {
+
+	return q->tail == &q->stub &&
+	       atomic_load_explicit(&q->head, memory_order_seq_cst) == &q->stub;
+}
+
+#endif /* MPSC_QUEUE_H */
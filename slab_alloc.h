@@ -0,0 +1,168 @@
+#ifndef SLAB_ALLOC_H
+#define SLAB_ALLOC_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+//
+// Fixed-size object allocator for hash table nodes.
+//
+// Memory comes in SLAB_CHUNK_SIZE chunks, aligned and advised so the
+// kernel can back each one with a single transparent huge page. Every
+// thread carves objects out of its own chunk and keeps its own free list,
+// so the fast path is a couple of pointer moves with no lock and no
+// per-object header. The allocator lock is only taken to hand out a new
+// chunk or to register a thread's cache. Teardown unmaps whole chunks;
+// objects are never returned one by one.
+//
+
+#define SLAB_CHUNK_SIZE        (2UL << 20)  /* one x86-64 huge page */
+#define SLAB_TLS_WAYS          4    /* allocators a thread keeps at hand */
+
+/* per-thread allocation state, one per allocator the thread has used */
+typedef struct slab_cache_t {
+	struct slab_cache_t *next;
+	pthread_t            owner;
+	void                *free_list;     /* freed objects, linked via first word */
+	char                *bump;          /* untouched space in the current chunk */
+	char                *bump_end;
+} slab_cache;
+
+typedef struct slab_allocator_t {
+	size_t            obj_size;
+	unsigned long     id;               /* tells allocators apart in TLS */
+	pthread_mutex_t   lock;             /* guards chunks and caches */
+	void             *chunks;           /* linked via their first word */
+	slab_cache       *caches;
+} slab_allocator;
+
+static _Atomic unsigned long slab_next_id = 1;
+
+/* the caches of the allocators this thread used last, by id */
+static __thread unsigned long slab_tls_id[SLAB_TLS_WAYS];
+static __thread slab_cache   *slab_tls_cache[SLAB_TLS_WAYS];
+
+static inline void slab_init(slab_allocator *slab, size_t obj_size) {
+
+	/* keep objects pointer aligned and big enough for the free list link */
+	if (obj_size < sizeof(void *)) obj_size = sizeof(void *);
+	slab->obj_size   = (obj_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	slab->id         = atomic_fetch_add(&slab_next_id, 1);
+	slab->chunks     = NULL;
+	slab->caches     = NULL;
+	pthread_mutex_init(&slab->lock, NULL);
+}
+
+/* map a huge-page aligned chunk; the first object slot holds the chunk link */
+static inline char *slab_map_chunk(slab_allocator *slab) {
+
+	char *raw, *chunk;
+	uintptr_t aligned;
+
+	/* over-map by one chunk and trim, mmap only promises page alignment */
+	raw = (char *) mmap(NULL, 2 * SLAB_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+	                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED) return NULL;
+	aligned = ((uintptr_t) raw + SLAB_CHUNK_SIZE - 1) & ~(SLAB_CHUNK_SIZE - 1);
+	chunk   = (char *) aligned;
+	if (chunk > raw) munmap(raw, chunk - raw);
+	munmap(chunk + SLAB_CHUNK_SIZE, raw + SLAB_CHUNK_SIZE - chunk);
+#ifdef MADV_HUGEPAGE
+	madvise(chunk, SLAB_CHUNK_SIZE, MADV_HUGEPAGE);
+#endif
+
+	pthread_mutex_lock(&slab->lock);
+	*(void **) chunk = slab->chunks;
+	slab->chunks     = chunk;
+	pthread_mutex_unlock(&slab->lock);
+	return chunk;
+}
+
+/* slow path: find or create this thread's cache for the allocator */
+static inline slab_cache *slab_thread_cache(slab_allocator *slab) {
+
+	slab_cache *cache;
+	pthread_t self = pthread_self();
+
+	pthread_mutex_lock(&slab->lock);
+	for (cache = slab->caches; cache; cache = cache->next) {
+		if (pthread_equal(cache->owner, self)) break;
+	}
+	if (!cache && (cache = (slab_cache *) calloc(1, sizeof(slab_cache)))) {
+		cache->owner = self;
+		cache->next  = slab->caches;
+		slab->caches = cache;
+	}
+	pthread_mutex_unlock(&slab->lock);
+
+	if (cache) {
+		slab_tls_id[slab->id % SLAB_TLS_WAYS]    = slab->id;
+		slab_tls_cache[slab->id % SLAB_TLS_WAYS] = cache;
+	}
+	return cache;
+}
+
+/* fast path: a thread using several allocators keeps them all at hand */
+static inline slab_cache *slab_cache_of(slab_allocator *slab) {
+
+	unsigned int way = slab->id % SLAB_TLS_WAYS;
+
+	return (slab_tls_id[way] == slab->id) ? slab_tls_cache[way] :\
+	       slab_thread_cache(slab);
+}
+
+static inline void *slab_alloc(slab_allocator *slab) {
+
+	slab_cache *cache = slab_cache_of(slab);
+	char *chunk;
+	void *obj;
+
+	if (!cache) return NULL;
+
+	if ((obj = cache->free_list) != NULL) {
+		cache->free_list = *(void **) obj;
+		return obj;
+	}
+	if (cache->bump + slab->obj_size > cache->bump_end) {
+		if ((chunk = slab_map_chunk(slab)) == NULL) return NULL;
+		cache->bump     = chunk + slab->obj_size;
+		cache->bump_end = chunk + SLAB_CHUNK_SIZE;
+	}
+	obj = cache->bump;
+	cache->bump += slab->obj_size;
+	return obj;
+}
+
+/* the object joins the free list of the calling thread, whoever allocated it */
+static inline void slab_free(slab_allocator *slab, void *obj) {
+
+	slab_cache *cache = slab_cache_of(slab);
+
+	if (!cache) return; /* leaks one object until teardown */
+	*(void **) obj   = cache->free_list;
+	cache->free_list = obj;
+}
+
+/* release every chunk at once; no object may be used afterwards */
+static inline void slab_destroy(slab_allocator *slab) {
+
+	void *chunk;
+	slab_cache *cache;
+
+	while ((chunk = slab->chunks) != NULL) {
+		slab->chunks = *(void **) chunk;
+		munmap(chunk, SLAB_CHUNK_SIZE);
+	}
+	while ((cache = slab->caches) != NULL) {
+		slab->caches = cache->next;
+		free(cache);
+	}
+	if (slab_tls_id[slab->id % SLAB_TLS_WAYS] == slab->id)
+		slab_tls_id[slab->id % SLAB_TLS_WAYS] = 0;
+	pthread_mutex_destroy(&slab->lock);
+}
+
+#endif /* SLAB_ALLOC_H */
@@ -0,0 +1,295 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "hash.h"
+
+//
+// Table snapshots: a flat, position-independent image of every key and
+// the value a RETR returns for it.
+//
+//    header     SNAPSHOT_HEADER_LEN bytes, see snapshot_header
+//    ctrl       capacity bytes, SNAPSHOT_SLOT_FULL or 0
+//    slots      capacity x { key, value }, at an 8 byte aligned offset
+//    expires    capacity x unix seconds the key expires at, 0 never
+//               (version 3 on)
+//
+// The slots form a linear-probing open-addressing table, capacity a power
+// of two, at most half full, indexed by the seeded hash of hash.h under
+// the seed saved in the header. There are no pointers in it, so the file can
+// be mapped anywhere and looked up in place: a restart maps it and serves
+// from it at once, pages come in as lookups touch them. All integers are
+// in host byte order; the header says which one.
+//
+// The mapping of a restart is private: an UPSERT or DEL of a key it holds
+// changes the value in place or leaves a SNAPSHOT_SLOT_DELETED tombstone,
+// in memory only, and the file stays as it was written. Images older than
+// version 3 get their expiry section from an anonymous zero mapping.
+//
+
+#define SNAPSHOT_MAGIC         "HTSNAP01"
+#define SNAPSHOT_VERSION       3    /* 1: unseeded snapshot_hash(), 2: no
+                                     * expiry times; both read only */
+#define SNAPSHOT_BYTE_ORDER    0x01020304u
+#define SNAPSHOT_HEADER_LEN    64
+#define SNAPSHOT_SLOT_FULL     1
+#define SNAPSHOT_SLOT_DELETED  2    /* in memory only, probing goes on */
+#define SNAPSHOT_MIN_CAPACITY  16
+
+typedef struct snapshot_header_t {
+	char       magic[8];
+	uint32_t   version;
+	uint32_t   byte_order;        /* SNAPSHOT_BYTE_ORDER as written */
+	uint64_t   capacity;
+	uint64_t   count;             /* full slots */
+	uint64_t   created;           /* CLOCK_REALTIME, seconds */
+	uint64_t   slots_offset;
+	uint64_t   hash_seed;         /* version 2 on */
+	uint64_t   expires_offset;    /* version 3 on */
+} snapshot_header;
+
+typedef struct snapshot_slot_t {
+	uint32_t   key;
+	uint32_t   value;
+} snapshot_slot;
+
+/* a mapped image, for lookups or while it is being built */
+typedef struct snapshot_t {
+	snapshot_header  *hdr;
+	uint8_t          *ctrl;
+	snapshot_slot    *slots;
+	uint32_t         *expires;
+	uint64_t          mask;
+	size_t            len;        /* of the mapping */
+	size_t            expires_len; /* of an anonymous expires mapping */
+	uint64_t          seed;
+	uint32_t          version;
+} snapshot;
+
+/* the index of version 1 images, also the WAL checksum mix */
+static inline uint32_t snapshot_hash(uint32_t key) {
+
+	key ^= key >> 16;
+	key *= 0x85ebca6b;
+	key ^= key >> 13;
+	key *= 0xc2b2ae35;
+	key ^= key >> 16;
+	return key;
+}
+
+static inline uint64_t snapshot_home(const snapshot *snap, uint32_t key) {
+
+	if (snap->version == 1) return snapshot_hash(key) & snap->mask;
+	return hash_mask(hash_key_seeded(key, snap->seed), snap->mask);
+}
+
+static inline size_t snapshot_file_len(uint32_t version, uint64_t capacity,\
+                                       uint64_t *slots_offset,\
+                                       uint64_t *expires_offset) {
+
+	*slots_offset   = (SNAPSHOT_HEADER_LEN + capacity + 7) & ~(uint64_t) 7;
+	*expires_offset = *slots_offset + capacity * sizeof(snapshot_slot);
+	if (version < 3) return *expires_offset;
+	return *expires_offset + capacity * sizeof(uint32_t);
+}
+
+/* slot index of key, or -1 */
+static inline int64_t snapshot_find(const snapshot *snap, uint32_t key,\
+                                    uint32_t *value) {
+
+	uint64_t i = snapshot_home(snap, key), probes;
+
+	uint8_t ctrl;
+
+	for (probes = 0; probes <= snap->mask; probes++) {
+		ctrl = __atomic_load_n(&snap->ctrl[i], __ATOMIC_ACQUIRE);
+		if (ctrl == 0) return -1;
+		if (ctrl == SNAPSHOT_SLOT_FULL && snap->slots[i].key == key) {
+			*value = __atomic_load_n(&snap->slots[i].value, __ATOMIC_ACQUIRE);
+			return i;
+		}
+		i = (i + 1) & snap->mask;
+	}
+	return -1;
+}
+
+/* a slot snapshot_find() returned, with writers of its key serialized */
+static inline void snapshot_set(snapshot *snap, int64_t slot, uint32_t value) {
+	__atomic_store_n(&snap->slots[slot].value, value, __ATOMIC_RELEASE);
+}
+
+static inline void snapshot_delete(snapshot *snap, int64_t slot) {
+	__atomic_store_n(&snap->ctrl[slot], SNAPSHOT_SLOT_DELETED, __ATOMIC_RELEASE);
+}
+
+/* unix seconds the key of a slot expires at, 0 never */
+static inline uint32_t snapshot_expires(const snapshot *snap, int64_t slot) {
+	return __atomic_load_n(&snap->expires[slot], __ATOMIC_ACQUIRE);
+}
+
+/* likewise serialized, after snapshot_set() */
+static inline void snapshot_set_expires(snapshot *snap, int64_t slot,\
+                                        uint32_t expires) {
+	__atomic_store_n(&snap->expires[slot], expires, __ATOMIC_RELEASE);
+}
+
+/* insert if absent: the first value added for a key is the one kept */
+static inline void snapshot_add(snapshot *snap, uint32_t key, uint32_t value,\
+                                uint32_t expires) {
+
+	uint64_t i = snapshot_home(snap, key);
+
+	while (snap->ctrl[i] == SNAPSHOT_SLOT_FULL) {
+		if (snap->slots[i].key == key) return;
+		i = (i + 1) & snap->mask;
+	}
+	snap->ctrl[i]        = SNAPSHOT_SLOT_FULL;
+	snap->slots[i].key   = key;
+	snap->slots[i].value = value;
+	snap->expires[i]     = expires;
+	snap->hdr->count++;
+}
+
+static inline void snapshot_close(snapshot *snap) {
+
+	if (snap->hdr) munmap(snap->hdr, snap->len);
+	if (snap->expires_len) munmap(snap->expires, snap->expires_len);
+	snap->hdr         = NULL;
+	snap->expires_len = 0;
+}
+
+// start an image of up to max_entries keys
+//
+// The file is sized up front and written through a shared mapping, so
+// the image needs no heap memory; snapshot_commit() makes it durable and
+// moves it over path. Returns -1 with errno set on failure.
+//
+static inline int snapshot_create(snapshot *snap, const char *tmp_path,\
+                                  uint64_t max_entries) {
+
+	uint64_t capacity = SNAPSHOT_MIN_CAPACITY, slots_offset, expires_offset;
+	int fd;
+
+	while (capacity < 2 * max_entries) capacity <<= 1;
+	snap->len = snapshot_file_len(SNAPSHOT_VERSION, capacity, &slots_offset,\
+	                              &expires_offset);
+
+	if ((fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) return -1;
+	if (ftruncate(fd, snap->len) < 0) {close(fd); return -1;}
+	snap->hdr = (snapshot_header *) mmap(NULL, snap->len, PROT_READ |\
+	            PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (snap->hdr == MAP_FAILED) {snap->hdr = NULL; return -1;}
+
+	/* a fresh file reads as zeroes: every ctrl byte is already empty */
+	memcpy(snap->hdr->magic, SNAPSHOT_MAGIC, sizeof(snap->hdr->magic));
+	snap->hdr->version      = SNAPSHOT_VERSION;
+	snap->hdr->byte_order   = SNAPSHOT_BYTE_ORDER;
+	snap->hdr->capacity     = capacity;
+	snap->hdr->count        = 0;
+	snap->hdr->created      = time(NULL);
+	snap->hdr->slots_offset = slots_offset;
+	snap->hdr->hash_seed    = hash_seed;
+	snap->hdr->expires_offset = expires_offset;
+	snap->expires_len       = 0;
+	snap->seed    = hash_seed;
+	snap->version = SNAPSHOT_VERSION;
+	snap->ctrl    = (uint8_t *) snap->hdr + SNAPSHOT_HEADER_LEN;
+	snap->slots   = (snapshot_slot *) ((char *) snap->hdr + slots_offset);
+	snap->expires = (uint32_t *) ((char *) snap->hdr + expires_offset);
+	snap->mask    = capacity - 1;
+	return 0;
+}
+
+/* make a create or rename in the directory of path durable */
+static inline int sync_parent_dir(const char *path) {
+
+	char dir[4096];
+	int fd, ret;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	if ((fd = open(dirname(dir), O_RDONLY | O_DIRECTORY)) < 0) return -1;
+	ret = fsync(fd);
+	close(fd);
+	return ret;
+}
+
+static inline int snapshot_commit(snapshot *snap, const char *tmp_path,\
+                                  const char *path) {
+
+	int fd, ret;
+
+	if (msync(snap->hdr, snap->len, MS_SYNC) < 0) return -1;
+	snapshot_close(snap);
+	if ((fd = open(tmp_path, O_RDONLY)) < 0) return -1;
+	ret = fsync(fd);
+	close(fd);
+	if (ret < 0 || rename(tmp_path, path) < 0) return -1;
+	return sync_parent_dir(path);
+}
+
+// map an image for lookups
+//
+// Private and without MAP_POPULATE: nothing is read until a lookup
+// touches it, and only pages an update writes get copied. Returns 0, or
+// -1 if the file is missing, short or of unknown format version.
+//
+static inline int snapshot_open(snapshot *snap, const char *path) {
+
+	struct stat st;
+	snapshot_header hdr;
+	uint64_t slots_offset, expires_offset;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) return -1;
+	if (fstat(fd, &st) < 0 || st.st_size < SNAPSHOT_HEADER_LEN ||\
+	    pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||\
+	    memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) ||\
+	    hdr.version < 1 || hdr.version > SNAPSHOT_VERSION ||\
+	    hdr.byte_order != SNAPSHOT_BYTE_ORDER ||\
+	    hdr.capacity < SNAPSHOT_MIN_CAPACITY ||\
+	    (hdr.capacity & (hdr.capacity - 1)) ||\
+	    hdr.capacity > ((uint64_t) 1 << 40) ||\
+	    snapshot_file_len(hdr.version, hdr.capacity, &slots_offset,\
+	                      &expires_offset) != (size_t) st.st_size ||\
+	    hdr.slots_offset != slots_offset ||\
+	    (hdr.version >= 3 && hdr.expires_offset != expires_offset)) {
+		close(fd);
+		return -1;
+	}
+	snap->len = st.st_size;
+	snap->hdr = (snapshot_header *) mmap(NULL, snap->len, PROT_READ |\
+	                                     PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (snap->hdr == MAP_FAILED) {snap->hdr = NULL; return -1;}
+	madvise(snap->hdr, snap->len, MADV_RANDOM);
+	snap->ctrl    = (uint8_t *) snap->hdr + SNAPSHOT_HEADER_LEN;
+	snap->slots   = (snapshot_slot *) ((char *) snap->hdr + slots_offset);
+	snap->expires = (uint32_t *) ((char *) snap->hdr + expires_offset);
+	snap->expires_len = 0;
+	if (hdr.version < 3) {
+		snap->expires_len = hdr.capacity * sizeof(uint32_t);
+		snap->expires = (uint32_t *) mmap(NULL, snap->expires_len,\
+		                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,\
+		                -1, 0);
+		if (snap->expires == MAP_FAILED) {
+			snap->expires_len = 0;
+			snapshot_close(snap);
+			return -1;
+		}
+	}
+	snap->mask    = hdr.capacity - 1;
+	snap->seed    = (hdr.version == 1) ? 0 : hdr.hash_seed;
+	snap->version = hdr.version;
+	return 0;
+}
+
+#endif /* SNAPSHOT_H */
@@ -0,0 +1,474 @@
+#ifndef SWISS_TABLE_H
+#define SWISS_TABLE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ebr.h"
+#include "hash.h"
+#include "lock_stripe.h"
+#include "timer_wheel.h"
+
+/* TSan cannot see through the vector loads, so it gets the byte-wise path */
+#if defined(__SSE2__) && !defined(__SANITIZE_THREAD__)
+#include <emmintrin.h>
+#define SWISS_USE_SSE2
+#endif
+
+//
+// Flat open-addressing table in the style of Swiss tables.
+//
+// Slots come in aligned groups of SWISS_GROUP_WIDTH. Every slot has one
+// control byte: SWISS_CTRL_EMPTY, SWISS_CTRL_BUSY while an insert fills
+// it in, or the low 7 bits of the key hash (H2) once it is full. A lookup
+// compares a whole group of control bytes against H2 with one SSE2
+// compare and only reads the inline key/value pairs of matching slots.
+// The remaining hash bits (H1) pick the home group; probing is quadratic
+// over groups and stops at the first group that still has an empty slot.
+//
+// Concurrency: readers take no lock and rely on the control byte being
+// stored with release after the key and value. A key always starts
+// probing at the same home group, so a spinlock striped by home group
+// makes find-or-insert, update and delete atomic per key, while the slot
+// itself is claimed with a CAS on its control byte because probe
+// sequences of different stripes overlap.
+//
+// A key that is already present is not inserted again, whatever its
+// value: only swiss_table_upsert() and swiss_table_cas() change a value,
+// with one atomic store. A delete leaves SWISS_CTRL_DELETED, so probing
+// goes on past it; the slot only becomes SWISS_CTRL_FREE for inserts to
+// reuse once EBR says no reader that saw the old key is left. Readers
+// must therefore run inside ebr_enter() / ebr_exit(). A slot never goes
+// back to SWISS_CTRL_EMPTY, which is what ends a probe.
+//
+// A key may carry an expiry time, in an array beside the slots. Once it
+// has passed, the key reads as missing: an insert or upsert takes its slot
+// over in place, and swiss_table_expire() deletes it.
+//
+// With max_entries set the table is a cache: swiss_table_evict() runs a
+// CLOCK hand over the slots, next to the referenced byte readers set.
+//
+
+#define SWISS_GROUP_WIDTH      16
+#define SWISS_CTRL_EMPTY       0x80
+#define SWISS_CTRL_FREE        0xFD /* deleted, reusable */
+#define SWISS_CTRL_DELETED     0xFE /* deleted, readers may still see it */
+#define SWISS_CTRL_BUSY        0xFF
+#define SWISS_NUM_STRIPES      1024 /* power of two */
+#define SWISS_MAX_LOAD(cap)    ((cap) - (cap) / 8)
+#define SWISS_EVICT_PER_INSERT 2
+#define SWISS_EVICT_SCAN_GROUPS 8   /* per insert, the next one goes on */
+
+enum { SWISS_INSERTED, SWISS_EXISTS, SWISS_FULL, SWISS_UPDATED,\
+       SWISS_MISSING, SWISS_MISMATCH };
+
+typedef struct swiss_slot_t {
+	uint32_t  key;
+	uint32_t  value;
+} swiss_slot;
+
+typedef struct swiss_table_t {
+	lock_stripe      stripes[SWISS_NUM_STRIPES];
+	uint8_t         *ctrl;          /* one control byte per slot */
+	swiss_slot      *slots;
+	uint32_t        *expires;       /* per slot, unix seconds, 0 never */
+	uint8_t         *referenced;    /* per slot, CLOCK bit */
+	size_t           capacity;      /* power of two, at least one group */
+	size_t           group_mask;    /* number of groups - 1 */
+	_Atomic size_t   used;          /* slots claimed or reserved by inserts,
+	                                 * until deleted and free again */
+	size_t           max_entries;   /* cache mode, 0 off; set before use */
+	_Atomic size_t   live;          /* full slots, kept in cache mode only */
+	_Atomic size_t   hand;          /* CLOCK hand, any group index mod groups */
+} swiss_table;
+
+/* both H1 and H2 need well mixed bits: the seeded hash of hash.h, H2 is
+ * the low 7 bits, H1 the bits above */
+static inline uint32_t swiss_hash(uint32_t key) {
+	return (uint32_t) hash_key(key);
+}
+
+/* bit i set for every control byte of the group equal to byte */
+static inline uint32_t swiss_group_match(const uint8_t *group, uint8_t byte) {
+
+#ifdef SWISS_USE_SSE2
+	__m128i ctrl = _mm_load_si128((const __m128i *) group);
+	return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl,\
+	                                    _mm_set1_epi8((char) byte)));
+#else
+	uint32_t mask = 0;
+	int i;
+
+	for (i = 0; i < SWISS_GROUP_WIDTH; i++) {
+		if (__atomic_load_n(&group[i], __ATOMIC_ACQUIRE) == byte)
+			mask |= 1u << i;
+	}
+	return mask;
+#endif
+}
+
+/* bit i set for every full slot of the group: control byte below 0x80 */
+static inline uint32_t swiss_group_full(const uint8_t *group) {
+
+#ifdef SWISS_USE_SSE2
+	__m128i ctrl = _mm_load_si128((const __m128i *) group);
+	return ~(uint32_t) _mm_movemask_epi8(ctrl) & 0xFFFF;
+#else
+	uint32_t mask = 0;
+	int i;
+
+	for (i = 0; i < SWISS_GROUP_WIDTH; i++) {
+		if (!(__atomic_load_n(&group[i], __ATOMIC_ACQUIRE) & SWISS_CTRL_EMPTY))
+			mask |= 1u << i;
+	}
+	return mask;
+#endif
+}
+
+static inline swiss_table *swiss_table_create(size_t capacity) {
+
+	swiss_table *t;
+	size_t cap = SWISS_GROUP_WIDTH, i;
+
+	while (cap < capacity) cap <<= 1;
+
+	t = (swiss_table *) cache_aligned_alloc(sizeof(swiss_table));
+	if (!t) return NULL;
+	t->ctrl  = (uint8_t *) cache_aligned_alloc(cap);
+	t->slots = (swiss_slot *) calloc(cap, sizeof(swiss_slot));
+	/* calloc: without TTLs its pages are never touched */
+	t->expires = (uint32_t *) calloc(cap, sizeof(uint32_t));
+	t->referenced = (uint8_t *) calloc(cap, 1);
+	if (!t->ctrl || !t->slots || !t->expires || !t->referenced) {
+		free(t->ctrl);
+		free(t->slots);
+		free(t->expires);
+		free(t->referenced);
+		free(t);
+		return NULL;
+	}
+	memset(t->ctrl, SWISS_CTRL_EMPTY, cap);
+	for (i = 0; i < SWISS_NUM_STRIPES; i++)
+		stripe_init(&t->stripes[i]);
+	t->capacity   = cap;
+	t->group_mask = cap / SWISS_GROUP_WIDTH - 1;
+	atomic_init(&t->used, 0);
+	t->max_entries = 0;
+	atomic_init(&t->live, 0);
+	atomic_init(&t->hand, 0);
+	return t;
+}
+
+static inline void swiss_table_free(swiss_table *t) {
+
+	free(t->ctrl);
+	free(t->slots);
+	free(t->expires);
+	free(t->referenced);
+	free(t);
+}
+
+static inline uint32_t swiss_slot_expires(swiss_table *t, size_t i) {
+	return __atomic_load_n(&t->expires[i], __ATOMIC_ACQUIRE);
+}
+
+/* lock free; NULL if the key is not (yet) in the table */
+static inline swiss_slot *swiss_table_find(swiss_table *t, uint32_t key,\
+                                           size_t *slot_idx) {
+
+	uint32_t h = swiss_hash(key), match;
+	uint8_t h2 = h & 0x7F;
+	size_t g = (h >> 7) & t->group_mask, step = 0, i;
+	const uint8_t *group;
+
+	while (1) {
+		group = t->ctrl + g * SWISS_GROUP_WIDTH;
+		for (match = swiss_group_match(group, h2); match; match &= match - 1) {
+			i = g * SWISS_GROUP_WIDTH + __builtin_ctz(match);
+			if (__atomic_load_n(&t->ctrl[i], __ATOMIC_ACQUIRE) == h2 &&
+			    t->slots[i].key == key) {
+				*slot_idx = i;
+				return &t->slots[i];
+			}
+		}
+		if (swiss_group_match(group, SWISS_CTRL_EMPTY)) return NULL;
+		if (++step > t->group_mask) return NULL; /* every group probed */
+		g = (g + step) & t->group_mask;
+	}
+}
+
+/* full slots; exact only while no insert is in flight */
+static inline size_t swiss_table_count(swiss_table *t) {
+
+	size_t i, count = 0;
+
+	for (i = 0; i < t->capacity; i++)
+		count += !(t->ctrl[i] & SWISS_CTRL_EMPTY);
+	return count;
+}
+
+/* start pulling in the home group of a key ahead of a find or insert */
+static inline void swiss_table_prefetch(swiss_table *t, uint32_t key) {
+
+	size_t g = (swiss_hash(key) >> 7) & t->group_mask;
+
+	__builtin_prefetch(t->ctrl + g * SWISS_GROUP_WIDTH);
+	__builtin_prefetch(t->slots + g * SWISS_GROUP_WIDTH);
+}
+
+/* the stripe serializing every change of key */
+static inline lock_stripe *swiss_stripe(swiss_table *t, uint32_t key) {
+	return &t->stripes[((swiss_hash(key) >> 7) & t->group_mask) &\
+	                   (SWISS_NUM_STRIPES - 1)];
+}
+
+// claim a slot for a key that is not in the table, its stripe held
+//
+// Takes the first empty or free slot of the probe sequence: a find for
+// the key stops at the first group with an empty slot, and no group
+// before the one taken has any.
+//
+static inline int swiss_table_add(swiss_table *t, uint32_t key,\
+                                  uint32_t value, uint32_t expires,\
+                                  size_t *slot_idx) {
+
+	uint32_t h = swiss_hash(key), match;
+	uint8_t h2 = h & 0x7F, expected;
+	size_t g = (h >> 7) & t->group_mask, step = 0, i;
+	const uint8_t *group;
+
+	/* reserving capacity up front guarantees the probe below ends */
+	if (atomic_fetch_add(&t->used, 1) >= SWISS_MAX_LOAD(t->capacity)) {
+		atomic_fetch_sub(&t->used, 1);
+		return SWISS_FULL;
+	}
+
+	while (1) {
+		group = t->ctrl + g * SWISS_GROUP_WIDTH;
+		match = swiss_group_match(group, SWISS_CTRL_EMPTY) |\
+		        swiss_group_match(group, SWISS_CTRL_FREE);
+		for (; match; match &= match - 1) {
+			i = g * SWISS_GROUP_WIDTH + __builtin_ctz(match);
+			expected = __atomic_load_n(&t->ctrl[i], __ATOMIC_RELAXED);
+			if ((expected != SWISS_CTRL_EMPTY && expected != SWISS_CTRL_FREE) ||\
+			    !__atomic_compare_exchange_n(&t->ctrl[i], &expected,\
+			        SWISS_CTRL_BUSY, false, __ATOMIC_ACQUIRE,\
+			        __ATOMIC_RELAXED))
+				continue; /* another stripe's insert got it first */
+			t->slots[i].key = key;
+			__atomic_store_n(&t->slots[i].value, value, __ATOMIC_RELAXED);
+			__atomic_store_n(&t->expires[i], expires, __ATOMIC_RELAXED);
+			__atomic_store_n(&t->referenced[i], 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&t->ctrl[i], h2, __ATOMIC_RELEASE);
+			if (t->max_entries) atomic_fetch_add(&t->live, 1);
+			*slot_idx = i;
+			return SWISS_INSERTED;
+		}
+		step++;
+		g = (g + step) & t->group_mask;
+	}
+}
+
+/* a found slot gets a new value and expiry; readers check the expiry
+ * after the value, so a reused expired slot never shows its old value */
+static inline void swiss_slot_set(swiss_table *t, size_t i, uint32_t value,\
+                                  uint32_t expires) {
+
+	__atomic_store_n(&t->slots[i].value, value, __ATOMIC_RELEASE);
+	__atomic_store_n(&t->expires[i], expires, __ATOMIC_RELEASE);
+}
+
+// find-or-insert; *slot_idx is where the key lives unless SWISS_FULL
+//
+// An expired key counts as missing: its slot is taken over in place and
+// the result is SWISS_INSERTED.
+//
+static inline int swiss_table_insert(swiss_table *t, uint32_t key,\
+                                     uint32_t value, uint32_t expires,\
+                                     size_t *slot_idx) {
+
+	lock_stripe *stripe = swiss_stripe(t, key);
+	int ret = SWISS_EXISTS;
+
+	stripe_write_lock(stripe);
+	if (!swiss_table_find(t, key, slot_idx)) {
+		ret = swiss_table_add(t, key, value, expires, slot_idx);
+	} else if (expiry_passed(swiss_slot_expires(t, *slot_idx))) {
+		swiss_slot_set(t, *slot_idx, value, expires);
+		ret = SWISS_INSERTED;
+	}
+	stripe_write_unlock(stripe);
+	return ret;
+}
+
+// insert or replace the value and expiry
+//
+// SWISS_INSERTED, SWISS_UPDATED or SWISS_FULL; *old_expires is the expiry
+// the key had, 0 if it had none or was missing.
+//
+static inline int swiss_table_upsert(swiss_table *t, uint32_t key,\
+                                     uint32_t value, uint32_t expires,\
+                                     uint32_t *old_expires, size_t *slot_idx) {
+
+	lock_stripe *stripe = swiss_stripe(t, key);
+	int ret = SWISS_UPDATED;
+
+	*old_expires = 0;
+	stripe_write_lock(stripe);
+	if (swiss_table_find(t, key, slot_idx) != NULL) {
+		*old_expires = swiss_slot_expires(t, *slot_idx);
+		if (expiry_passed(*old_expires)) {
+			*old_expires = 0;
+			ret = SWISS_INSERTED;
+		}
+		swiss_slot_set(t, *slot_idx, value, expires);
+	} else {
+		ret = swiss_table_add(t, key, value, expires, slot_idx);
+	}
+	stripe_write_unlock(stripe);
+	return ret;
+}
+
+/* replace the value only if it is expected; *value gets the one found,
+ * *expires the expiry the key keeps */
+static inline int swiss_table_cas(swiss_table *t, uint32_t key,\
+                                  uint32_t expected, uint32_t *value,\
+                                  uint32_t *expires, size_t *slot_idx) {
+
+	lock_stripe *stripe = swiss_stripe(t, key);
+	swiss_slot *slot;
+	uint32_t found;
+	int ret = SWISS_MISSING;
+
+	*expires = 0;
+	stripe_write_lock(stripe);
+	if ((slot = swiss_table_find(t, key, slot_idx)) != NULL &&\
+	    !expiry_passed(*expires = swiss_slot_expires(t, *slot_idx))) {
+		found = __atomic_load_n(&slot->value, __ATOMIC_RELAXED);
+		if (found == expected) {
+			__atomic_store_n(&slot->value, *value, __ATOMIC_RELEASE);
+			ret = SWISS_UPDATED;
+		} else {
+			*value = found;
+			ret = SWISS_MISMATCH;
+		}
+	}
+	stripe_write_unlock(stripe);
+	return ret;
+}
+
+/* EBR callback: nobody can still be looking at the deleted key */
+static void swiss_free_slot(void *ctx, void *ptr) {
+
+	swiss_table *t = (swiss_table *) ctx;
+
+	__atomic_store_n(&t->ctrl[(uintptr_t) ptr], SWISS_CTRL_FREE,\
+	                 __ATOMIC_RELEASE);
+	atomic_fetch_sub(&t->used, 1);
+}
+
+/* a found slot to SWISS_CTRL_DELETED, its stripe held */
+static inline void swiss_slot_remove(swiss_table *t, size_t i) {
+
+	__atomic_store_n(&t->ctrl[i], SWISS_CTRL_DELETED, __ATOMIC_RELEASE);
+	if (t->max_entries) atomic_fetch_sub(&t->live, 1);
+	ebr_retire(swiss_free_slot, t, (void *) (uintptr_t) i);
+}
+
+/* a reader hit slot i: a plain store, once per pass of the hand */
+static inline void swiss_slot_touch(swiss_table *t, size_t i) {
+
+	if (!__atomic_load_n(&t->referenced[i], __ATOMIC_RELAXED))
+		__atomic_store_n(&t->referenced[i], 1, __ATOMIC_RELAXED);
+}
+
+/* remove key, its value into *value; false if it was not there, or had
+ * expired: then it is removed all the same */
+static inline bool swiss_table_delete(swiss_table *t, uint32_t key,\
+                                      uint32_t *value, size_t *slot_idx) {
+
+	lock_stripe *stripe = swiss_stripe(t, key);
+	swiss_slot *slot;
+	bool live;
+
+	stripe_write_lock(stripe);
+	if ((slot = swiss_table_find(t, key, slot_idx)) == NULL) {
+		stripe_write_unlock(stripe);
+		return false;
+	}
+	live = !expiry_passed(swiss_slot_expires(t, *slot_idx));
+	if (live) *value = __atomic_load_n(&slot->value, __ATOMIC_RELAXED);
+	swiss_slot_remove(t, *slot_idx);
+	stripe_write_unlock(stripe);
+	return live;
+}
+
+/* remove key only if it expired by now; else *expires is its expiry, 0 if
+ * it has none or is missing */
+static inline bool swiss_table_expire(swiss_table *t, uint32_t key,\
+                                      uint32_t now, uint32_t *expires) {
+
+	lock_stripe *stripe = swiss_stripe(t, key);
+	size_t slot_idx;
+	bool expired = false;
+
+	*expires = 0;
+	stripe_write_lock(stripe);
+	if (swiss_table_find(t, key, &slot_idx) != NULL) {
+		*expires = swiss_slot_expires(t, slot_idx);
+		if ((expired = (*expires && *expires <= now)))
+			swiss_slot_remove(t, slot_idx);
+	}
+	stripe_write_unlock(stripe);
+	return expired;
+}
+
+// cache mode: evict until the table is back at max_entries
+//
+// The hand is shared and counts groups, every evictor moves it on with
+// one fetch_add, so no lock is held while scanning; one control load
+// tells the full slots of a group. A slot read since the hand last passed
+// gets a second chance; the first that was not, or has expired, is
+// deleted under its key's stripe once that still holds the same key. An
+// insert scans SWISS_EVICT_SCAN_GROUPS groups at most and leaves the rest
+// to the next. The caller is in an EBR section, holds no stripe and
+// passes the key it just inserted as keep. Returns the number of keys
+// evicted.
+//
+static inline size_t swiss_table_evict(swiss_table *t, uint32_t keep) {
+
+	size_t scanned, evicted = 0, g, i;
+	lock_stripe *stripe;
+	uint32_t key, full;
+	uint8_t ctrl;
+
+	for (scanned = 0; atomic_load(&t->live) > t->max_entries &&\
+	     evicted < SWISS_EVICT_PER_INSERT && scanned < SWISS_EVICT_SCAN_GROUPS;\
+	     scanned++) {
+		g = atomic_fetch_add_explicit(&t->hand, 1, memory_order_relaxed) &\
+		    t->group_mask;
+		full = swiss_group_full(t->ctrl + g * SWISS_GROUP_WIDTH);
+		for (; full && evicted < SWISS_EVICT_PER_INSERT; full &= full - 1) {
+			i    = g * SWISS_GROUP_WIDTH + __builtin_ctz(full);
+			ctrl = __atomic_load_n(&t->ctrl[i], __ATOMIC_ACQUIRE);
+			if (ctrl & SWISS_CTRL_EMPTY) continue;    /* gone meanwhile */
+			if (__atomic_load_n(&t->referenced[i], __ATOMIC_RELAXED) &&\
+			    !expiry_passed(swiss_slot_expires(t, i))) {
+				__atomic_store_n(&t->referenced[i], 0, __ATOMIC_RELAXED);
+				continue;
+			}
+			if ((key = t->slots[i].key) == keep) continue;
+			stripe = swiss_stripe(t, key);
+			stripe_write_lock(stripe);
+			if (__atomic_load_n(&t->ctrl[i], __ATOMIC_RELAXED) == ctrl &&\
+			    t->slots[i].key == key) {
+				swiss_slot_remove(t, i);
+				evicted++;
+			}
+			stripe_write_unlock(stripe);
+		}
+	}
+	return evicted;
+}
+
+#endif /* SWISS_TABLE_H */
@@ -0,0 +1,263 @@
+#define TABLE_BENCH_MODE
+#include "server.c"
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+//
+// Table microbenchmark: the hash table engines without sockets or workers.
+//
+// For every fill level, from 10% to 1000% of HASH_TABLE_SIZE keys, a fresh
+// table is filled and then timed, single threaded, for
+//
+//    insert    STOR of a new key (resizes included, as a server pays them)
+//    hit       RETR of a stored key
+//    miss      RETR of a key that was never stored
+//    dup       STOR of a stored key and value, which finds it and stops
+//    hash      hash() alone, chained engine only
+//
+// in ns per operation and, where perf events are allowed, last level
+// cache misses per operation. Lookups run in a shuffled order so that
+// hits are not helped by insertion order. The chained engine also reports
+// how long its chains are after the fill. An engine for narrow keys
+// (direct) only runs the fill levels whose keys and miss keys both fit
+// its key space.
+//
+// Compilation and run:
+// 	$ gcc -O2 table_bench.c -o table_bench -pthread
+// 	$ ./table_bench [-e chained|swiss|direct] [-n min_ops_per_phase]
+//
+
+#define BENCH_MIN_OPS          1000000  /* per timed phase, by repeating keys */
+#define BENCH_CHAIN_BUCKETS    9        /* chains of length 0..7, then 8+ */
+
+static const unsigned int bench_fill_pct[] = { 10, 25, 50, 100, 200, 500, 1000 };
+#define NUM_FILL_LEVELS (sizeof(bench_fill_pct) / sizeof(bench_fill_pct[0]))
+
+/* one timed phase: elapsed time and cache misses over ops operations */
+typedef struct bench_result_t {
+	double   ns_per_op;
+	double   misses_per_op;            /* < 0 if not measured */
+} bench_result;
+
+static int perf_fd = -1;
+
+/* count LLC misses of this thread in user space, if the kernel lets us */
+static inline void bench_perf_open(void) {
+
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type           = PERF_TYPE_HARDWARE;
+	attr.size           = sizeof(attr);
+	attr.config         = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled       = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv     = 1;
+	perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (perf_fd < 0)
+		fprintf(stderr, "perf events unavailable (%s), no cache misses\n",\
+		        strerror(errno));
+}
+
+static inline uint64_t bench_perf_read(void) {
+
+	uint64_t count = 0;
+
+	if (perf_fd >= 0 && read(perf_fd, &count, sizeof(count)) != sizeof(count))
+		count = 0;
+	return count;
+}
+
+/* distinct for every i below 2^bits, and scattered over the key space */
+static inline unsigned int bench_key(unsigned int i, unsigned int bits) {
+	return (i * 2654435761u) & (unsigned int) ((1ULL << bits) - 1);
+}
+
+static inline void bench_shuffle(unsigned int *keys, unsigned int n) {
+
+	uint64_t x = 0x9E3779B97F4A7C15ULL;
+	unsigned int i, j, tmp;
+
+	for (i = n - 1; i > 0; i--) {
+		x ^= x >> 12; x ^= x << 25; x ^= x >> 27;
+		j = (x * 0x2545F4914F6CDD1DULL >> 32) % (i + 1);
+		tmp = keys[i]; keys[i] = keys[j]; keys[j] = tmp;
+	}
+}
+
+static volatile unsigned int bench_sink;
+
+// timed phase
+//
+// Runs cb over the keys, round after round, until at least min_ops
+// operations are done; rounds after the first see the same table, so
+// only the insert phase (a single round) changes it.
+//
+static inline bench_result bench_phase(void *(*cb)(void *), void *table,\
+                                       const unsigned int *keys, unsigned int n,\
+                                       unsigned int min_ops, bool same_value) {
+
+	bench_result res;
+	thread_data tdata;
+	uint64_t start, misses, ops = 0;
+	unsigned int i;
+
+	tdata.hash_table = table;
+	tdata.expires    = 0;
+	if (perf_fd >= 0) {
+		ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	start = metrics_now();
+	do {
+		for (i = 0; i < n; i++) {
+			tdata.key   = keys[i];
+			tdata.value = same_value ? keys[i] : 0;
+			cb(&tdata);
+			bench_sink += tdata.status;
+		}
+		ops += n;
+	} while (ops < min_ops);
+	res.ns_per_op = (double) (metrics_now() - start) / ops;
+	if (perf_fd >= 0) ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+	misses = bench_perf_read();
+	res.misses_per_op = (perf_fd >= 0) ? (double) misses / ops : -1;
+	return res;
+}
+
+/* hash() alone, over the current bucket array */
+static inline bench_result bench_hash(hash_table_t *table,\
+                                      const unsigned int *keys, unsigned int n,\
+                                      unsigned int min_ops) {
+
+	bench_result res;
+	bucket_array *cur = atomic_load(&table->buckets);
+	uint64_t start, ops = 0;
+	unsigned int i, sum = 0;
+
+	start = metrics_now();
+	do {
+		for (i = 0; i < n; i++) sum += hash(cur, keys[i]);
+		ops += n;
+	} while (ops < min_ops);
+	res.ns_per_op     = (double) (metrics_now() - start) / ops;
+	res.misses_per_op = -1;
+	bench_sink += sum;
+	return res;
+}
+
+/* chain lengths of the current bucket array of a chained table */
+static inline void bench_chain_report(hash_table_t *table) {
+
+	bucket_array *cur = atomic_load(&table->buckets);
+	unsigned long dist[BENCH_CHAIN_BUCKETS] = {0}, total = 0, used = 0;
+	unsigned int i, len, max = 0;
+	htcl *node;
+
+	for (i = 0; i < cur->size; i++) {
+		for (len = 0, node = chain_head(cur, i); node; node = node->next)
+			len++;
+		dist[(len < BENCH_CHAIN_BUCKETS - 1) ? len : BENCH_CHAIN_BUCKETS - 1]++;
+		total += len;
+		used  += (len > 0);
+		if (len > max) max = len;
+	}
+	printf("        chains of %u buckets%s:", cur->size,\
+	       atomic_load(&table->old_buckets) ? " (still migrating)" : "");
+	for (i = 0; i < BENCH_CHAIN_BUCKETS; i++)
+		printf(" %u%s:%lu", i, (i == BENCH_CHAIN_BUCKETS - 1) ? "+" : "",\
+		       dist[i]);
+	printf("  mean %.2f max %u\n", used ? (double) total / used : 0.0, max);
+}
+
+static inline void bench_print(bench_result res) {
+
+	if (res.misses_per_op >= 0)
+		printf(" %8.1f/%-5.2f", res.ns_per_op, res.misses_per_op);
+	else
+		printf(" %8.1f%6s", res.ns_per_op, "");
+}
+
+int main(int argc, char *argv[]) {
+
+	unsigned int *keys, *miss_keys, *lookup_keys, n, max_n, f, e, i;
+	unsigned int min_ops = BENCH_MIN_OPS;
+	bench_result ins, hit, miss, dup, hsh;
+	void *table;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "e:n:")) != -1) {
+		switch (opt) {
+		case 'e':
+			for (e = 0; e < NUM_TABLE_ENGINES; e++) {
+				if (!strcmp(optarg, table_engines[e].name)) break;
+			}
+			if (e == NUM_TABLE_ENGINES) {
+				fprintf(stderr, "%s: unknown engine %s\n", argv[0], optarg);
+				exit(1);
+			}
+			engine = &table_engines[e];
+			break;
+		case 'n':
+			min_ops = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage:  %s [-e chained|swiss|direct] [-n min_ops]\n",\
+			        argv[0]);
+			exit(1);
+		}
+	}
+
+	max_n       = HASH_TABLE_SIZE * bench_fill_pct[NUM_FILL_LEVELS - 1] / 100;
+	if ((1ULL << engine->key_bits) / 2 < max_n)
+		max_n = (1ULL << engine->key_bits) / 2;
+	keys        = (unsigned int *) malloc(max_n * sizeof(unsigned int));
+	miss_keys   = (unsigned int *) malloc(max_n * sizeof(unsigned int));
+	lookup_keys = (unsigned int *) malloc(max_n * sizeof(unsigned int));
+	if (!keys || !miss_keys || !lookup_keys) error("ERROR allocating keys");
+	for (i = 0; i < max_n; i++) {
+		keys[i]      = bench_key(i, engine->key_bits);
+		miss_keys[i] = bench_key(max_n + i, engine->key_bits);
+	}
+	bench_perf_open();
+
+	printf("engine %s, HASH_TABLE_SIZE %u, ns/op%s\n", engine->name,\
+	       HASH_TABLE_SIZE, (perf_fd >= 0) ? "/LLC misses per op" : "");
+	printf("%6s %8s %14s %14s %14s %14s %14s\n", "fill%", "keys",\
+	       "insert", "hit", "miss", "dup", "hash");
+
+	for (f = 0; f < NUM_FILL_LEVELS; f++) {
+		n = HASH_TABLE_SIZE * bench_fill_pct[f] / 100;
+		if (n > max_n) break;
+		if ((table = engine->create()) == NULL) error("ERROR creating table");
+		my_hash_table = table;
+
+		ins = bench_phase(engine->wcb, table, keys, n, 0, true);
+		memcpy(lookup_keys, keys, n * sizeof(unsigned int));
+		bench_shuffle(lookup_keys, n);
+		hit  = bench_phase(engine->rcb, table, lookup_keys, n, min_ops, true);
+		miss = bench_phase(engine->rcb, table, miss_keys, n, min_ops, true);
+		dup  = bench_phase(engine->wcb, table, lookup_keys, n, min_ops, true);
+
+		printf("%6u %8u", bench_fill_pct[f], n);
+		bench_print(ins);
+		bench_print(hit);
+		bench_print(miss);
+		bench_print(dup);
+		if (engine->create == create_hash_table) {
+			hsh = bench_hash((hash_table_t *) table, lookup_keys, n, min_ops);
+			bench_print(hsh);
+			printf("\n");
+			bench_chain_report((hash_table_t *) table);
+		} else {
+			printf("\n");
+		}
+		engine->destroy(table);
+	}
+
+	if (bench_sink == 0xdeadbeef) printf("\n");
+	free(keys);
+	free(miss_keys);
+	free(lookup_keys);
+	return 0;
+}
@@ -0,0 +1,92 @@
+#ifndef THREAD_REGISTRY_H
+#define THREAD_REGISTRY_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+//
+// Per-thread slot registry.
+//
+// EBR records, log rings and metrics blocks all follow one pattern: a
+// thread takes a slot the first time it needs one and keeps it for its
+// lifetime, its exit hands the slot back through a TLS destructor, and
+// the next new thread reuses it before anything is allocated. Slots are
+// never unlinked or freed, so readers walk the list without a lock while
+// threads come and go.
+//
+// A thread claims with thread_registry_claim(); on NULL it allocates and
+// initializes a slot of its own and publishes it with thread_registry_add().
+// Either way the slot is owned from then on and released at thread exit.
+//
+
+/* embed as the first member of any struct kept in a registry */
+typedef struct thread_slot_t {
+	_Atomic int            in_use;      /* owned by a live thread */
+	struct thread_slot_t  *next;        /* all slots, never unlinked */
+} thread_slot;
+
+typedef struct thread_registry_t {
+	thread_slot * _Atomic  slots;
+	_Atomic int            key_made;
+	pthread_mutex_t        key_lock;
+	pthread_key_t          key;
+	void                 (*release)(void *slot);   /* runs at thread exit */
+} thread_registry;
+
+#define THREAD_REGISTRY_INIT(release_fn) {\
+	.slots = NULL, .key_made = 0, .key_lock = PTHREAD_MUTEX_INITIALIZER,\
+	.release = (release_fn) }
+
+/* the default destructor, and the last step of any other one */
+static void thread_slot_release(void *arg) {
+	atomic_store_explicit(&((thread_slot *) arg)->in_use, 0,\
+	                      memory_order_release);
+}
+
+/* ties the slot to the calling thread, the destructor gives it back */
+static inline void thread_registry_own(thread_registry *r, thread_slot *slot) {
+
+	if (!atomic_load_explicit(&r->key_made, memory_order_acquire)) {
+		pthread_mutex_lock(&r->key_lock);
+		if (!atomic_load_explicit(&r->key_made, memory_order_relaxed)) {
+			pthread_key_create(&r->key, r->release);
+			atomic_store_explicit(&r->key_made, 1, memory_order_release);
+		}
+		pthread_mutex_unlock(&r->key_lock);
+	}
+	pthread_setspecific(r->key, slot);
+}
+
+/* reuse the slot of an exited thread; NULL when every slot is taken */
+static inline thread_slot *thread_registry_claim(thread_registry *r) {
+
+	thread_slot *slot;
+	int expected;
+
+	for (slot = atomic_load(&r->slots); slot; slot = slot->next) {
+		expected = 0;
+		if (atomic_compare_exchange_strong(&slot->in_use, &expected, 1)) {
+			thread_registry_own(r, slot);
+			return slot;
+		}
+	}
+	return NULL;
+}
+
+/* publish a new slot, initialized by the caller, as owned by this thread */
+static inline void thread_registry_add(thread_registry *r, thread_slot *slot) {
+
+	atomic_init(&slot->in_use, 1);
+	slot->next = atomic_load(&r->slots);
+	while (!atomic_compare_exchange_weak(&r->slots, &slot->next, slot))
+		;
+	thread_registry_own(r, slot);
+}
+
+/* readers: every slot ever added, newest first */
+static inline thread_slot *thread_registry_first(thread_registry *r) {
+	return atomic_load(&r->slots);
+}
+
+#endif /* THREAD_REGISTRY_H */
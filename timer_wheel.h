@@ -0,0 +1,226 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//
+// Hierarchical timing wheel for key expiry.
+//
+// Times are unix seconds, as expiry times are kept in the tables, the WAL
+// and snapshots. Level 0 has a slot per second for the next
+// TIMER_WHEEL_SLOTS seconds, every level above a slot per
+// TIMER_WHEEL_SLOTS slots of the level below; a timer further out than
+// the top level reaches waits in its last slot and is placed again when
+// that slot comes due. Adding a timer is O(1). Whenever the wheel passes
+// a whole slot of a level, that slot is moved down into the levels below
+// (cascade), so every timer is touched once per level at most.
+//
+// A timer only names a key and when it was due: whoever fires it looks
+// the key up and decides, so a key whose expiry moved meanwhile needs no
+// cancel. Adders may run on any thread; the owning event loop takes due
+// timers out a budget at a time and fires them with the lock released.
+// The first timer of an empty wheel calls wake, so a loop that had
+// nothing to wait for learns it has now.
+//
+
+#define TIMER_WHEEL_BITS       6
+#define TIMER_WHEEL_SLOTS      (1u << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS     4    /* 2^24 s, about 194 days, ahead */
+
+typedef struct wheel_timer_t {
+	struct wheel_timer_t  *next;
+	uint32_t               key;
+	uint32_t               expires;      /* unix seconds */
+} wheel_timer;
+
+typedef struct timer_wheel_t {
+	pthread_mutex_t   lock;
+	uint32_t          now;               /* next second to fire, 0: unset */
+	size_t            pending;           /* timers in the slots */
+	wheel_timer      *free_list;         /* recycled by fire, reused by add */
+	void            (*wake)(void *arg);  /* or NULL, set before any add */
+	void             *wake_arg;
+	wheel_timer      *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel;
+
+/* unix seconds; the coarse clock is a few ms stale at most and cheap */
+static inline uint32_t expiry_now(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	return (uint32_t) ts.tv_sec;
+}
+
+/* an expiry time of 0 is never */
+static inline bool expiry_passed(uint32_t expires) {
+	return expires && expires <= expiry_now();
+}
+
+static inline void timer_wheel_init(timer_wheel *w) {
+
+	pthread_mutex_init(&w->lock, NULL);
+	w->now       = 0;
+	w->pending   = 0;
+	w->free_list = NULL;
+	w->wake      = NULL;
+	w->wake_arg  = NULL;
+	memset(w->slots, 0, sizeof(w->slots));
+}
+
+/* the slot of t relative to w->now, lock held */
+static inline void timer_wheel_place(timer_wheel *w, wheel_timer *t) {
+
+	uint32_t at = (t->expires > w->now) ? t->expires : w->now;
+	uint32_t delta = at - w->now;
+	unsigned int level = 0;
+
+	while (level < TIMER_WHEEL_LEVELS - 1 &&\
+	       delta >= (1u << (TIMER_WHEEL_BITS * (level + 1))))
+		level++;
+	if (delta >= (1u << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)))
+		at = w->now + (1u << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+	at = (at >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+	t->next = w->slots[level][at];
+	w->slots[level][at] = t;
+}
+
+/* key expires at expires; false if no memory for the timer */
+static inline bool timer_wheel_add(timer_wheel *w, uint32_t key,\
+                                   uint32_t expires) {
+
+	wheel_timer *t;
+	bool first;
+
+	pthread_mutex_lock(&w->lock);
+	if ((t = w->free_list) != NULL) {
+		w->free_list = t->next;
+	} else if ((t = (wheel_timer *) malloc(sizeof(wheel_timer))) == NULL) {
+		pthread_mutex_unlock(&w->lock);
+		return false;
+	}
+	if (!w->now) w->now = expiry_now();
+	t->key     = key;
+	t->expires = expires;
+	timer_wheel_place(w, t);
+	first = (w->pending++ == 0);
+	pthread_mutex_unlock(&w->lock);
+	if (first && w->wake) w->wake(w->wake_arg);
+	return true;
+}
+
+/* move the slot of level due at w->now down a level; lock held */
+static inline unsigned int timer_wheel_cascade(timer_wheel *w,\
+                                               unsigned int level) {
+
+	unsigned int idx = (w->now >> (TIMER_WHEEL_BITS * level)) &\
+	                   (TIMER_WHEEL_SLOTS - 1);
+	wheel_timer *t = w->slots[level][idx], *next;
+
+	w->slots[level][idx] = NULL;
+	for (; t; t = next) {
+		next = t->next;
+		timer_wheel_place(w, t);
+	}
+	return idx;
+}
+
+// take due timers
+//
+// Moves the wheel on towards now and hands back up to budget timers that
+// are due, linked through next; the caller fires them and gives them
+// back with timer_wheel_put_back(). If budget runs out the wheel stays
+// at the second it was in and *more is set: call again without sleeping.
+//
+static inline wheel_timer *timer_wheel_take(timer_wheel *w, uint32_t now,\
+                                            unsigned int budget, bool *more) {
+
+	wheel_timer *due = NULL, **slot, *t;
+	unsigned int level, idx;
+
+	*more = false;
+	pthread_mutex_lock(&w->lock);
+	while (w->pending && w->now && w->now <= now) {
+		idx = w->now & (TIMER_WHEEL_SLOTS - 1);
+		/* entering a new round of a level: bring its next slot down */
+		for (level = 1; idx == 0 && level < TIMER_WHEEL_LEVELS; level++) {
+			if (timer_wheel_cascade(w, level) != 0) break;
+		}
+		slot = &w->slots[0][w->now & (TIMER_WHEEL_SLOTS - 1)];
+		while ((t = *slot) != NULL && budget) {
+			*slot   = t->next;
+			t->next = due;
+			due     = t;
+			w->pending--;
+			budget--;
+		}
+		if (*slot) {
+			*more = true;
+			break;
+		}
+		w->now++;
+	}
+	if (!w->pending) w->now = 0;     /* start over from the next add */
+	pthread_mutex_unlock(&w->lock);
+	return due;
+}
+
+/* timers taken and fired: expires set to 0 if done, else the new time */
+static inline void timer_wheel_put_back(timer_wheel *w, wheel_timer *list) {
+
+	wheel_timer *t, *next;
+
+	if (!list) return;
+	pthread_mutex_lock(&w->lock);
+	for (t = list; t; t = next) {
+		next = t->next;
+		if (!t->expires) {
+			t->next      = w->free_list;
+			w->free_list = t;
+			continue;
+		}
+		if (!w->now) w->now = expiry_now();
+		timer_wheel_place(w, t);
+		w->pending++;
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* every timer, due or not; nobody may use the wheel any more */
+static inline void timer_wheel_free(timer_wheel *w) {
+
+	wheel_timer *t, *next;
+	unsigned int level, i;
+
+	for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		for (i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+			for (t = w->slots[level][i]; t; t = next) {
+				next = t->next;
+				free(t);
+			}
+		}
+	}
+	for (t = w->free_list; t; t = next) {
+		next = t->next;
+		free(t);
+	}
+	pthread_mutex_destroy(&w->lock);
+}
+
+/* seconds until the wheel has to move on, -1 if it holds no timer */
+static inline int timer_wheel_idle(timer_wheel *w, uint32_t now) {
+
+	int ret = -1;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->pending) ret = (w->now > now) ? (int) (w->now - now) : 0;
+	pthread_mutex_unlock(&w->lock);
+	return ret;
+}
+
+#endif /* TIMER_WHEEL_H */
@@ -0,0 +1,340 @@
+#ifndef URING_H
+#define URING_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+//
+// Minimal io_uring, on the raw system calls and linux/io_uring.h.
+//
+// One ring per event loop, set up and driven by the loop's own thread
+// only (IORING_SETUP_SINGLE_ISSUER). Submissions are queued in the
+// shared SQ ring and go to the kernel with the next uring_enter(), which
+// also waits for completions: one system call per round of the loop,
+// however many connections it served.
+//
+// Connections live in the ring's registered file table only: a multishot
+// accept puts each in a free slot (IORING_FILE_INDEX_ALLOC) and every
+// later operation names the slot, never an fd. Received data lands in a
+// provided buffer ring the kernel picks from, so a multishot recv needs
+// no buffer of its own while the connection is idle; a buffer goes back
+// to the ring with uring_buf_recycle() once its bytes are used.
+//
+// uring_init() fails with -errno on kernels that lack any of that
+// (multishot recv, SINGLE_ISSUER and buffer rings all came in 6.0), or
+// where io_uring is switched off; the caller falls back to epoll.
+//
+
+#define URING_BGID             0    /* group of the provided buffer ring */
+
+typedef struct uring_t {
+	int                   fd;
+	/* submission queue, shared with the kernel */
+	unsigned int         *sq_head;
+	unsigned int         *sq_tail;
+	unsigned int          sq_mask;
+	unsigned int          sq_entries;
+	unsigned int          sq_local;      /* tail of the SQEs handed out */
+	struct io_uring_sqe  *sqes;
+	/* completion queue, likewise */
+	unsigned int         *cq_head;
+	unsigned int         *cq_tail;
+	unsigned int          cq_mask;
+	struct io_uring_cqe  *cqes;
+	void                 *ring_mem;      /* SQ and CQ rings, one mapping */
+	size_t                ring_len;
+	size_t                sqes_len;
+	/* provided buffers: the ring of free ones and the memory behind them */
+	struct io_uring_buf_ring *br;
+	size_t                br_len;
+	char                 *bufs;
+	unsigned int          buf_count;     /* power of two */
+	unsigned int          buf_len;
+	uint16_t              br_tail;
+} uring;
+
+static inline int uring_setup(unsigned int entries, struct io_uring_params *p) {
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int uring_register(int fd, unsigned int op, void *arg,\
+                                 unsigned int nr) {
+	return (int) syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+/* the memory of a buffer id */
+static inline char *uring_buf(uring *r, unsigned int bid) {
+	return r->bufs + (size_t) bid * r->buf_len;
+}
+
+/* give a buffer back to the kernel */
+static inline void uring_buf_recycle(uring *r, unsigned int bid) {
+
+	struct io_uring_buf *buf = &r->br->bufs[r->br_tail & (r->buf_count - 1)];
+
+	buf->addr = (uint64_t) (uintptr_t) uring_buf(r, bid);
+	buf->len  = r->buf_len;
+	buf->bid  = (uint16_t) bid;
+	__atomic_store_n(&r->br->tail, ++r->br_tail, __ATOMIC_RELEASE);
+}
+
+static inline void uring_free(uring *r) {
+
+	if (r->fd >= 0) close(r->fd);
+	if (r->ring_mem && r->ring_mem != MAP_FAILED) munmap(r->ring_mem, r->ring_len);
+	if (r->sqes && (void *) r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_len);
+	if (r->br && (void *) r->br != MAP_FAILED) munmap(r->br, r->br_len);
+	if (r->bufs && (void *) r->bufs != MAP_FAILED)
+		munmap(r->bufs, (size_t) r->buf_count * r->buf_len);
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+}
+
+// ring setup
+//
+// entries SQEs, a sparse table of nfiles registered files and buf_count
+// provided buffers of buf_len bytes. Returns 0, or -errno with nothing
+// left allocated.
+//
+static inline int uring_init(uring *r, unsigned int entries, unsigned int nfiles,\
+                             unsigned int buf_count, unsigned int buf_len) {
+
+	struct io_uring_params p;
+	struct io_uring_rsrc_register files;
+	struct io_uring_buf_reg reg;
+	char *ring;
+	unsigned int i;
+	int err;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	/* task work only when we enter the kernel anyway, 6.1 and later */
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	if ((r->fd = uring_setup(entries, &p)) < 0 && errno == EINVAL) {
+		memset(&p, 0, sizeof(p));
+		p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+		r->fd = uring_setup(entries, &p);
+	}
+	if (r->fd < 0) {
+		err = -errno;
+		r->fd = -1;
+		return err;
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+		uring_free(r);
+		return -EOPNOTSUPP;
+	}
+
+	r->ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > r->ring_len)
+		r->ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->ring_mem = mmap(NULL, r->ring_len, PROT_READ | PROT_WRITE,\
+	                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes     = (struct io_uring_sqe *) mmap(NULL, r->sqes_len,\
+	              PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,\
+	              IORING_OFF_SQES);
+	if (r->ring_mem == MAP_FAILED || (void *) r->sqes == MAP_FAILED) {
+		err = -errno;
+		uring_free(r);
+		return err;
+	}
+	ring          = (char *) r->ring_mem;
+	r->sq_head    = (unsigned int *) (ring + p.sq_off.head);
+	r->sq_tail    = (unsigned int *) (ring + p.sq_off.tail);
+	r->sq_mask    = *(unsigned int *) (ring + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	r->sq_local   = *r->sq_tail;
+	r->cq_head    = (unsigned int *) (ring + p.cq_off.head);
+	r->cq_tail    = (unsigned int *) (ring + p.cq_off.tail);
+	r->cq_mask    = *(unsigned int *) (ring + p.cq_off.ring_mask);
+	r->cqes       = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+	/* SQE i always sits at index i, the array never changes */
+	for (i = 0; i < p.sq_entries; i++)
+		((unsigned int *) (ring + p.sq_off.array))[i] = i;
+
+	memset(&files, 0, sizeof(files));
+	files.nr    = nfiles;
+	files.flags = IORING_RSRC_REGISTER_SPARSE;
+	if (uring_register(r->fd, IORING_REGISTER_FILES2, &files,\
+	                   sizeof(files)) < 0) {
+		err = -errno;
+		uring_free(r);
+		return err;
+	}
+
+	r->buf_count = buf_count;
+	r->buf_len   = buf_len;
+	r->br_len    = buf_count * sizeof(struct io_uring_buf);
+	r->br   = (struct io_uring_buf_ring *) mmap(NULL, r->br_len,\
+	          PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	r->bufs = (char *) mmap(NULL, (size_t) buf_count * buf_len,\
+	          PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ((void *) r->br == MAP_FAILED || r->bufs == MAP_FAILED) {
+		err = -ENOMEM;
+		uring_free(r);
+		return err;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr    = (uint64_t) (uintptr_t) r->br;
+	reg.ring_entries = buf_count;
+	reg.bgid         = URING_BGID;
+	if (uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		err = -errno;
+		uring_free(r);
+		return err;
+	}
+	for (i = 0; i < buf_count; i++) uring_buf_recycle(r, i);
+	return 0;
+}
+
+// enter the kernel
+//
+// Submits every queued SQE and, with wait set, waits for a completion
+// for up to timeout_ms (-1: no limit). Returns false on an error other
+// than running out of time or being interrupted.
+//
+static inline bool uring_enter(uring *r, bool wait, int timeout_ms) {
+
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int flags = IORING_ENTER_EXT_ARG;
+	int ret;
+
+	memset(&arg, 0, sizeof(arg));
+	if (wait) flags |= IORING_ENTER_GETEVENTS;
+	if (wait && timeout_ms >= 0) {
+		ts.tv_sec  = timeout_ms / 1000;
+		ts.tv_nsec = (long long) (timeout_ms % 1000) * 1000000;
+		arg.ts     = (uint64_t) (uintptr_t) &ts;
+	}
+	__atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+	ret = (int) syscall(__NR_io_uring_enter, r->fd,\
+	                    r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE),\
+	                    wait ? 1 : 0, flags, &arg, sizeof(arg));
+	return ret >= 0 || errno == ETIME || errno == EINTR || errno == EBUSY;
+}
+
+/* room for n more SQEs, submitting what is queued if need be */
+static inline void uring_sq_room(uring *r, unsigned int n) {
+
+	while (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) + n >\
+	       r->sq_entries)
+		uring_enter(r, false, 0);
+}
+
+/* a zeroed SQE */
+static inline struct io_uring_sqe *uring_get_sqe(uring *r) {
+
+	struct io_uring_sqe *sqe;
+
+	uring_sq_room(r, 1);
+	sqe = &r->sqes[r->sq_local++ & r->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/* the next completion, or NULL; uring_cqe_seen() once it is handled */
+static inline struct io_uring_cqe *uring_peek_cqe(uring *r) {
+
+	unsigned int head = *r->cq_head;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+	return &r->cqes[head & r->cq_mask];
+}
+
+static inline void uring_cqe_seen(uring *r) {
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* accept into free registered file slots until cancelled or failing */
+static inline void uring_prep_accept_multishot(struct io_uring_sqe *sqe,\
+                                               int fd, uint64_t data) {
+
+	sqe->opcode      = IORING_OP_ACCEPT;
+	sqe->fd          = fd;
+	sqe->ioprio      = IORING_ACCEPT_MULTISHOT;
+	sqe->file_index  = IORING_FILE_INDEX_ALLOC;
+	sqe->user_data   = data;
+}
+
+/* receive into provided buffers until the peer closes or buffers run out */
+static inline void uring_prep_recv_multishot(struct io_uring_sqe *sqe,\
+                                             unsigned int slot, uint64_t data) {
+
+	sqe->opcode      = IORING_OP_RECV;
+	sqe->fd          = (int) slot;
+	sqe->flags       = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+	sqe->ioprio      = IORING_RECV_MULTISHOT;
+	sqe->buf_group   = URING_BGID;
+	sqe->user_data   = data;
+}
+
+static inline void uring_prep_send(struct io_uring_sqe *sqe, unsigned int slot,\
+                                   const void *buf, unsigned int len,\
+                                   uint64_t data) {
+
+	sqe->opcode      = IORING_OP_SEND;
+	sqe->fd          = (int) slot;
+	sqe->flags       = IOSQE_FIXED_FILE;
+	sqe->addr        = (uint64_t) (uintptr_t) buf;
+	sqe->len         = len;
+	sqe->msg_flags   = MSG_NOSIGNAL;
+	sqe->user_data   = data;
+}
+
+/* poll events on fd, one completion each time they come up, until
+ * cancelled */
+static inline void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd,\
+                                             unsigned int events, uint64_t data) {
+
+	sqe->opcode        = IORING_OP_POLL_ADD;
+	sqe->fd            = fd;
+	sqe->len           = IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = events;
+	sqe->user_data     = data;
+}
+
+static inline void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf,\
+                                   unsigned int len, uint64_t data) {
+
+	sqe->opcode      = IORING_OP_READ;
+	sqe->fd          = fd;
+	sqe->addr        = (uint64_t) (uintptr_t) buf;
+	sqe->len         = len;
+	sqe->user_data   = data;
+}
+
+/* shut the socket of a slot down, then free the slot whatever happened:
+ * the shutdown ends the multishot recv still on it */
+static inline void uring_prep_close_slot(uring *r, unsigned int slot,\
+                                         uint64_t data) {
+
+	struct io_uring_sqe *sqe;
+
+	uring_sq_room(r, 2);            /* a link must go in one submission */
+	sqe = uring_get_sqe(r);
+	sqe->opcode      = IORING_OP_SHUTDOWN;
+	sqe->fd          = (int) slot;
+	sqe->flags       = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+	sqe->len         = SHUT_RDWR;
+	sqe->user_data   = data;
+
+	sqe = uring_get_sqe(r);
+	sqe->opcode      = IORING_OP_CLOSE;
+	sqe->file_index  = slot + 1;
+	sqe->user_data   = data;
+}
+
+#endif /* URING_H */
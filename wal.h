@@ -0,0 +1,384 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <errno.h>
+#include <glob.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "metrics.h"
+#include "snapshot.h"
+
+//
+// Write-ahead log of table changes with group commit.
+//
+// Writers copy their records into a shared buffer under a mutex and get
+// back their log sequence number (LSN), the count of records appended up
+// to and including theirs. One flusher thread swaps that buffer for a
+// spare one, writes it and calls fdatasync once for the whole batch;
+// while it waits for the disk the next batch piles up behind it, so the
+// more writers there are the more records share one sync.
+//
+// A reply must not leave before its record is durable: the caller parks
+// it on the log with wal_hold() and the flusher hands it back through
+// on_durable once the LSN it waits for is synced. Waiters complete in the
+// order they were held, and all waiters up to an LSN complete before
+// wal->durable says it is reached.
+//
+// The log is a series of segments, path.00000001, path.00000002, ...
+// Each starts with a wal_record header {WAL_MAGIC, WAL_VERSION, segment,
+// 0} and holds records numbered from 0 within it, each with a checksum,
+// so replay stops cleanly at a torn tail. The top bits of a record's seq
+// say what it does, WAL_OP_*; version 1 logs hold only STORs and read the
+// same, as do version 2 logs, which have no expiry times. wal_cut() makes
+// later records go to a new segment; once a snapshot taken after the cut
+// is durable, wal_compact() deletes everything up to it. Nothing else
+// trims the log, so the server takes -W only along with -s.
+//
+
+#define WAL_MAGIC              0x4C575448u  /* "HTWL" */
+#define WAL_VERSION            3    /* 1: STOR records only, 2: no EXPIRES */
+#define WAL_SEGMENT_LEN        (64 << 20)   /* bytes, then the next segment */
+#define WAL_BUFFER_RECORDS     4096         /* initial size, grows on demand */
+#define WAL_NAME_LEN           4096
+#define WAL_PATH_MAX           (WAL_NAME_LEN - sizeof(".4294967295")) /* -W */
+
+/* replaying a record in log order gives back the state it was logged in */
+#define WAL_OP_STOR            0    /* add the key if it is missing */
+#define WAL_OP_UPSERT          1    /* set the value, also of a CAS */
+#define WAL_OP_DEL             2
+#define WAL_OP_EXPIRES         3    /* value: expiry of the STOR or UPSERT of
+                                     * key right after it, unix seconds */
+#define WAL_OP_SHIFT           28
+#define WAL_SEQ_MASK           ((1u << WAL_OP_SHIFT) - 1)
+
+typedef struct wal_record_t {
+	uint32_t   key;
+	uint32_t   value;
+	uint32_t   seq;             /* within the segment, from 0, op on top */
+	uint32_t   check;
+} wal_record;
+
+/* link of a reply held until its records are durable */
+typedef struct wal_waiter_t {
+	struct wal_waiter_t  *next;
+	uint64_t              lsn;
+} wal_waiter;
+
+typedef struct wal_log_t {
+	pthread_mutex_t    lock;
+	pthread_cond_t     work;           /* the flusher has something to do */
+	wal_record        *buf;            /* appenders fill this one */
+	size_t             len, cap;
+	wal_waiter        *waiters;        /* held, in order */
+	wal_waiter       **waiters_tail;
+	uint64_t           appended;       /* LSN of the last record appended */
+	unsigned int       active;         /* segment of the next swapped batch */
+	_Atomic uint64_t   durable;        /* LSN up to which all is synced */
+
+	/* flusher only */
+	wal_record        *spare;
+	size_t             spare_cap;
+	unsigned int       segment;        /* open segment */
+	uint32_t           seq;            /* next record number in it */
+	size_t             segment_len;
+	int                fd;
+
+	const char        *path;
+	void             (*on_durable)(wal_waiter *waiter);
+} wal_log;
+
+static inline uint32_t wal_check(uint32_t key, uint32_t value, uint32_t seq) {
+	return snapshot_hash(key ^ snapshot_hash(value ^ snapshot_hash(seq +\
+	                     0x9E3779B9u)));
+}
+
+/* validate_input() keeps path to WAL_PATH_MAX, so the number always fits */
+static inline void wal_segment_name(char *name, const char *path,\
+                                    unsigned int segment) {
+
+	if (snprintf(name, WAL_NAME_LEN, "%s.%08u", path, segment) >=\
+	    WAL_NAME_LEN) {
+		fprintf(stderr, "ERROR: WAL prefix %s is too long\n", path);
+		exit(1);
+	}
+}
+
+/* segment number of a file name of this log, 0 if it is none */
+static inline unsigned int wal_segment_of(const char *name, const char *path) {
+
+	size_t n = strlen(path);
+	char *end;
+	unsigned long segment;
+
+	if (strncmp(name, path, n) || name[n] != '.' || strlen(name + n + 1) != 8)
+		return 0;
+	segment = strtoul(name + n + 1, &end, 10);
+	return (*end || segment > 0xFFFFFFFFul) ? 0 : (unsigned int) segment;
+}
+
+static inline void wal_open_segment(wal_log *wal, unsigned int segment) {
+
+	char name[WAL_NAME_LEN];
+	wal_record hdr = { WAL_MAGIC, WAL_VERSION, segment, 0 };
+
+	if (wal->fd >= 0) close(wal->fd);
+	wal_segment_name(name, wal->path, segment);
+	wal->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (wal->fd < 0 || write(wal->fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||\
+	    fdatasync(wal->fd) < 0 || sync_parent_dir(name) < 0) {
+		perror("ERROR creating WAL segment");
+		exit(1);
+	}
+	wal->segment     = segment;
+	wal->seq         = 0;
+	wal->segment_len = sizeof(hdr);
+}
+
+// replay
+//
+// Feeds every record of every segment of path to apply, oldest first, and
+// returns how many there were (apply may be NULL to only count them);
+// *last is the highest segment number seen, 0 if there is no log yet. A
+// segment ends at its first record that is short or fails its checksum:
+// the tail of a write the crash cut off.
+//
+static inline uint64_t wal_replay(const char *path, unsigned int *last,\
+                                  void (*apply)(void *ctx, unsigned int op,\
+                                                uint32_t key, uint32_t value),\
+                                  void *ctx) {
+
+	char pattern[WAL_NAME_LEN];
+	wal_record rec;
+	glob_t g;
+	uint64_t count = 0;
+	unsigned int segment;
+	uint32_t seq;
+	size_t i;
+	FILE *f;
+
+	*last = 0;
+	snprintf(pattern, sizeof(pattern), "%s.*", path);
+	if (glob(pattern, 0, NULL, &g) != 0) return 0;
+	for (i = 0; i < g.gl_pathc; i++) {   /* sorted: fixed width numbers */
+		if ((segment = wal_segment_of(g.gl_pathv[i], path)) == 0) continue;
+		if ((f = fopen(g.gl_pathv[i], "rb")) == NULL) continue;
+		if (fread(&rec, sizeof(rec), 1, f) == 1 && rec.key == WAL_MAGIC &&\
+		    rec.value >= 1 && rec.value <= WAL_VERSION && rec.seq == segment) {
+			for (seq = 0; fread(&rec, sizeof(rec), 1, f) == 1; seq++) {
+				if ((rec.seq & WAL_SEQ_MASK) != seq ||\
+				    rec.check != wal_check(rec.key, rec.value, rec.seq))
+					break;
+				if (apply) apply(ctx, rec.seq >> WAL_OP_SHIFT, rec.key,\
+				                 rec.value);
+				count++;
+			}
+		}
+		fclose(f);
+		if (segment > *last) *last = segment;
+	}
+	globfree(&g);
+	return count;
+}
+
+/* delete segments up to and including cut, once a snapshot covers them */
+static inline void wal_compact(const char *path, unsigned int cut) {
+
+	char pattern[WAL_NAME_LEN];
+	unsigned int segment;
+	glob_t g;
+	size_t i;
+
+	snprintf(pattern, sizeof(pattern), "%s.*", path);
+	if (glob(pattern, 0, NULL, &g) != 0) return;
+	for (i = 0; i < g.gl_pathc; i++) {
+		segment = wal_segment_of(g.gl_pathv[i], path);
+		if (segment && segment <= cut) unlink(g.gl_pathv[i]);
+	}
+	globfree(&g);
+	sync_parent_dir(path);
+}
+
+// append
+//
+// Copies n records (key and value set, seq holding WAL_OP_* << WAL_OP_SHIFT)
+// into the log and returns the LSN of the last one. Durable once
+// wal->durable reaches it.
+//
+static inline uint64_t wal_append(wal_log *wal, const wal_record *recs,\
+                                  size_t n) {
+
+	uint64_t lsn;
+
+	pthread_mutex_lock(&wal->lock);
+	if (wal->len + n > wal->cap) {
+		while (wal->len + n > wal->cap) wal->cap *= 2;
+		wal->buf = (wal_record *) realloc(wal->buf, wal->cap * sizeof(wal_record));
+		if (!wal->buf) {perror("ERROR growing WAL buffer"); exit(1);}
+	}
+	memcpy(wal->buf + wal->len, recs, n * sizeof(wal_record));
+	if (wal->len == 0 && wal->waiters == NULL) pthread_cond_signal(&wal->work);
+	wal->len      += n;
+	wal->appended += n;
+	lsn = wal->appended;
+	pthread_mutex_unlock(&wal->lock);
+	return lsn;
+}
+
+// hold a reply until lsn is durable
+//
+// Returns false if it already is, and the caller sends the reply itself;
+// otherwise on_durable gets the waiter later. A reply that follows a held
+// one on the same connection must be held too, with the same or a later
+// LSN, or it could overtake it.
+//
+static inline bool wal_hold(wal_log *wal, wal_waiter *waiter, uint64_t lsn) {
+
+	/* durable only moves after every waiter up to it got on_durable, so
+	 * a reply let through here cannot pass one that is still held */
+	if (lsn <= atomic_load_explicit(&wal->durable, memory_order_acquire))
+		return false;
+	pthread_mutex_lock(&wal->lock);
+	if (lsn <= atomic_load_explicit(&wal->durable, memory_order_relaxed)) {
+		pthread_mutex_unlock(&wal->lock);
+		return false;
+	}
+	waiter->next = NULL;
+	waiter->lsn  = lsn;
+	if (wal->len == 0 && wal->waiters == NULL) pthread_cond_signal(&wal->work);
+	*wal->waiters_tail = waiter;
+	wal->waiters_tail  = &waiter->next;
+	pthread_mutex_unlock(&wal->lock);
+	return true;
+}
+
+/* start a new segment: returns the last one a snapshot taken from now on
+ * makes obsolete */
+static inline unsigned int wal_cut(wal_log *wal) {
+
+	unsigned int cut;
+
+	pthread_mutex_lock(&wal->lock);
+	cut = wal->active++;
+	pthread_mutex_unlock(&wal->lock);
+	return cut;
+}
+
+/* under wal->lock: release every waiter up to end, then publish end */
+static inline void wal_release(wal_log *wal, uint64_t end) {
+
+	wal_waiter **link = &wal->waiters, *waiter;
+
+	/* each appender's LSNs only grow, so skipping the later ones keeps
+	 * the order of every connection */
+	while ((waiter = *link) != NULL) {
+		if (waiter->lsn <= end) {
+			*link = waiter->next;     /* on_durable may reuse the waiter */
+			wal->on_durable(waiter);
+		} else {
+			link = &waiter->next;
+		}
+	}
+	wal->waiters_tail = link;
+	atomic_store_explicit(&wal->durable, end, memory_order_release);
+}
+
+// flusher thread
+//
+// One batch per round: swap the buffers, stamp and write the records, one
+// fdatasync, then release the waiters the batch covers. A failed write or
+// sync ends the server; its acknowledgements could no longer be trusted.
+//
+static void *wal_flusher_main(void *arg) {
+
+	wal_log *wal = (wal_log *) arg;
+	wal_record *batch;
+	uint64_t end, start;
+	size_t len, i, off;
+	ssize_t n;
+	unsigned int target;
+
+	while (1) {
+		pthread_mutex_lock(&wal->lock);
+		while (wal->len == 0 && wal->waiters == NULL)
+			pthread_cond_wait(&wal->work, &wal->lock);
+		batch       = wal->buf;
+		len         = wal->len;
+		wal->buf    = wal->spare;
+		wal->spare  = batch;
+		i           = wal->cap;
+		wal->cap    = wal->spare_cap;
+		wal->spare_cap = i;
+		wal->len    = 0;
+		end         = wal->appended;
+		if (wal->segment_len >= WAL_SEGMENT_LEN && wal->active == wal->segment)
+			wal->active++;
+		target      = wal->active;
+		pthread_mutex_unlock(&wal->lock);
+
+		if (len) {
+			start = metrics_now();
+			if (target != wal->segment) wal_open_segment(wal, target);
+			for (i = 0; i < len; i++) {
+				batch[i].seq   = (batch[i].seq & ~WAL_SEQ_MASK) | wal->seq++;
+				batch[i].check = wal_check(batch[i].key, batch[i].value,\
+				                           batch[i].seq);
+			}
+			for (off = 0; off < len * sizeof(wal_record); off += n) {
+				n = write(wal->fd, (char *) batch + off,\
+				          len * sizeof(wal_record) - off);
+				if (n < 0 && errno == EINTR) {n = 0; continue;}
+				if (n <= 0) {perror("ERROR writing WAL"); exit(1);}
+			}
+			if (fdatasync(wal->fd) < 0) {perror("ERROR syncing WAL"); exit(1);}
+			wal->segment_len += len * sizeof(wal_record);
+			metrics_add(MET_WAL_RECORDS, len);
+			metrics_add(MET_WAL_SYNCS, 1);
+			metrics_record(MET_HIST_WAL_SYNC, start);
+		}
+		pthread_mutex_lock(&wal->lock);
+		wal_release(wal, end);
+		pthread_mutex_unlock(&wal->lock);
+	}
+	return NULL;
+}
+
+// open the log for appending
+//
+// Records go to segment first_segment and up, which must be newer than
+// anything replayed; older segments are left for wal_compact().
+//
+static inline void wal_start(wal_log *wal, const char *path,\
+                             unsigned int first_segment,\
+                             void (*on_durable)(wal_waiter *waiter)) {
+
+	pthread_t thread;
+
+	memset(wal, 0, sizeof(*wal));
+	pthread_mutex_init(&wal->lock, NULL);
+	pthread_cond_init(&wal->work, NULL);
+	wal->cap          = WAL_BUFFER_RECORDS;
+	wal->spare_cap    = WAL_BUFFER_RECORDS;
+	wal->buf          = (wal_record *) malloc(wal->cap * sizeof(wal_record));
+	wal->spare        = (wal_record *) malloc(wal->spare_cap * sizeof(wal_record));
+	wal->waiters_tail = &wal->waiters;
+	wal->path         = path;
+	wal->on_durable   = on_durable;
+	wal->fd           = -1;
+	atomic_init(&wal->durable, 0);
+	if (!wal->buf || !wal->spare) {perror("ERROR allocating WAL"); exit(1);}
+	wal_open_segment(wal, first_segment);
+	wal->active = first_segment;
+
+	if (pthread_create(&thread, NULL, wal_flusher_main, wal)) {
+		perror("ERROR creating WAL flusher thread");
+		exit(1);
+	}
+	pthread_detach(thread);
+}
+
+#endif /* WAL_H */